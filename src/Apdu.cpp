@@ -0,0 +1,150 @@
+/*
+ * QEstEidUtil
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "Apdu.h"
+
+#include <QtCore/QDebug>
+#include <QtCore/QMutex>
+#include <QtCore/QThread>
+
+#ifdef Q_OS_WIN
+#undef UNICODE
+#include <Windows.h>
+#include <winscard.h>
+#elif defined(Q_OS_MAC)
+#include <PCSC/wintypes.h>
+#include <PCSC/winscard.h>
+#else
+#include <winscard.h>
+#endif
+
+// Card pulled out, rest of the read plan can be dropped at once
+bool CardFile::cardRemoved(const QPCSCReader::Result &result)
+{
+	return quint32(result.err) == quint32(SCARD_W_REMOVED_CARD);
+}
+
+QHash<quint8,QByteArray> CardFile::parseFCI(const QByteArray &data)
+{
+	QHash<quint8,QByteArray> result;
+	for(QByteArray::const_iterator i = data.constBegin(); i != data.constEnd(); ++i)
+	{
+		quint8 tag(*i), size(*++i);
+		result[tag] = QByteArray(i + 1, size);
+		switch(tag)
+		{
+		case 0x6F:
+		case 0x62:
+		case 0x64:
+		case 0xA1: continue;
+		default: i += size; break;
+		}
+	}
+	return result;
+}
+
+QByteArray CardFile::readBinary(QPCSCReader *reader, int size, QByteArray data, const volatile bool *stop)
+{
+	// QPCSCReader receives at most 1 kB including status word
+	static const int extendedChunk = 0x0400 - 2;
+	// Extended length support per reader and card, T=0 cannot carry extended APDUs
+	static QMutex lock;
+	static QHash<QString,bool> extendedSupport;
+	const QString key = reader->name() + "/" + reader->atr();
+
+	int failed = 0;
+	while(data.size() < size)
+	{
+		bool extended = reader->protocol() == QPCSCReader::T1;
+		if(extended)
+		{
+			QMutexLocker locker(&lock);
+			extended = extendedSupport.value(key, true);
+		}
+
+		int le = qMin(size - data.size(), extended ? extendedChunk : 0x0100);
+		Apdu cmd(APDU_LITERAL("00B00000"));
+		cmd[2] = char(data.size() >> 8);
+		cmd[3] = char(data.size());
+		if(extended)
+			cmd << char(0) << char(le >> 8) << char(le);
+		else
+			cmd << char(le); // 0x100 is encoded as 00
+
+		QPCSCReader::Result result = transfer(reader, cmd);
+		QByteArray chunk;
+		// T=0 wrong length, resend with length from card
+		if(!result.err && result.SW.size() == 2 && quint8(result.SW[0]) == 0x6C)
+		{
+			cmd[cmd.size() - 1] = result.SW[1];
+			result = transfer(reader, cmd);
+		}
+		// T=0 more data available
+		while(!result.err && result.SW.size() == 2 && quint8(result.SW[0]) == 0x61)
+		{
+			chunk += result.data;
+			Apdu getResponse(APDU_LITERAL("00C00000 00"));
+			getResponse[4] = result.SW[1];
+			result = transfer(reader, getResponse);
+		}
+		chunk += result.data;
+
+		if(cardRemoved(result))
+			return QByteArray();
+		// Card or reader rejects extended length command, transport errors are retried below
+		quint8 sw1 = result.SW.size() == 2 ? quint8(result.SW[0]) : 0;
+		if(extended && !result.err && (
+			(sw1 == 0x67 && quint8(result.SW[1]) == 0x00) || sw1 == 0x6D || sw1 == 0x6E))
+		{
+			qDebug() << "Extended length READ BINARY not supported" << key;
+			QMutexLocker locker(&lock);
+			extendedSupport[key] = false;
+			continue;
+		}
+		// Retry failed chunk, already read data is kept
+		if((!result.resultOk() || chunk.isEmpty()) && ++failed < readAttempts && !(stop && *stop))
+		{
+			QThread::msleep(readBackoff << (failed - 1));
+			continue;
+		}
+		if(!result.resultOk() || chunk.isEmpty())
+			return QByteArray();
+		failed = 0;
+		if(extended)
+		{
+			QMutexLocker locker(&lock);
+			extendedSupport[key] = true;
+		}
+		data += chunk;
+
+		// File may be larger than the DER structure in it
+		if(data.size() >= 4 && quint8(data[0]) == 0x30 && quint8(data[1]) == 0x82)
+			size = qMin(size, 4 + (quint8(data[2]) << 8 | quint8(data[3])));
+	}
+	return data.left(size);
+}
+
+QPCSCReader::Result CardFile::transfer(QPCSCReader *reader, const Apdu &apdu)
+{
+	if(apdu.isValid())
+		return reader->transfer(apdu.data());
+	QPCSCReader::Result result;
+	result.err = quint32(SCARD_E_INVALID_PARAMETER);
+	return result;
+}
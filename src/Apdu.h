@@ -0,0 +1,139 @@
+/*
+ * QEstEidUtil
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#pragma once
+
+#include <common/QPCSC.h>
+
+#include <QtCore/QHash>
+
+#include <cstring>
+
+constexpr int hexValue(char c)
+{
+	return c >= '0' && c <= '9' ? c - '0' :
+		c >= 'A' && c <= 'F' ? c - 'A' + 10 :
+		c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+template<int... I> struct ApduIndices {};
+template<int N, int... I> struct ApduMakeIndices: ApduMakeIndices<N - 1, N - 1, I...> {};
+template<int... I> struct ApduMakeIndices<0, I...> { typedef ApduIndices<I...> type; };
+
+/*
+ * Hex APDU literal, spaces only separate fields. Use APDU_LITERAL, it parses
+ * the text at compile time and rejects bad digits and odd digit counts.
+ */
+class ApduLiteral
+{
+public:
+	static const int maxSize = 24; // Header, AID and Le
+
+	template<size_t N>
+	constexpr ApduLiteral(const char (&hex)[N])
+		: ApduLiteral(hex, typename ApduMakeIndices<maxSize>::type()) {}
+
+	constexpr const char* data() const { return bytes; }
+	constexpr int size() const { return length; }
+	constexpr bool isValid() const { return valid; }
+
+private:
+	template<int... I>
+	constexpr ApduLiteral(const char *hex, ApduIndices<I...>)
+		: bytes{ byte(hex, I)... }
+		, length(digits(hex) / 2)
+		, valid(check(hex) && digits(hex) % 2 == 0 && digits(hex) / 2 <= maxSize) {}
+
+	static constexpr bool check(const char *s)
+	{ return *s == 0 || ((*s == ' ' || hexValue(*s) >= 0) && check(s + 1)); }
+	static constexpr int digits(const char *s)
+	{ return *s == 0 ? 0 : (*s == ' ' ? 0 : 1) + digits(s + 1); }
+	static constexpr const char* skip(const char *s)
+	{ return *s == ' ' ? skip(s + 1) : s; }
+	static constexpr const char* digit(const char *s, int n)
+	{ return *skip(s) == 0 || n == 0 ? skip(s) : digit(skip(s) + 1, n - 1); }
+	static constexpr int nibble(char c)
+	{ return hexValue(c) < 0 ? 0 : hexValue(c); } // Bad digit is reported by isValid()
+	static constexpr char byte(const char *s, int i)
+	{
+		return *digit(s, 2 * i) == 0 || *digit(s, 2 * i + 1) == 0 ? 0 :
+			char(nibble(*digit(s, 2 * i)) << 4 | nibble(*digit(s, 2 * i + 1)));
+	}
+
+	char bytes[maxSize];
+	int length;
+	bool valid;
+};
+
+#define APDU_LITERAL(hex) [] { \
+	static_assert(ApduLiteral(hex).isValid(), "Invalid APDU literal " hex); \
+	constexpr ApduLiteral literal(hex); \
+	return literal; }()
+
+// Command APDU in stack buffer, patching and appending data does not allocate
+class Apdu
+{
+public:
+	Apdu(const ApduLiteral &literal): length(literal.size())
+	{ memcpy(buffer, literal.data(), size_t(length)); }
+
+	char& operator[](int i) { Q_ASSERT(i >= 0 && i < length); return buffer[i]; }
+	Apdu& operator<<(char value) { return append(&value, 1); }
+	Apdu& operator<<(const QByteArray &data) { return append(data.constData(), data.size()); }
+	// Refers to buffer, valid while Apdu exists. Empty when appended data did not fit
+	QByteArray data() const { return overflow ? QByteArray() : QByteArray::fromRawData(buffer, length); }
+	bool isValid() const { return !overflow; }
+	int size() const { return length; }
+
+private:
+	Apdu& append(const char *data, int size)
+	{
+		// Truncated data would no longer match Lc
+		Q_ASSERT_X(size <= maxSize - length, "Apdu", "APDU does not fit short APDU buffer");
+		if(size > maxSize - length)
+			overflow = true;
+		else
+		{
+			memcpy(buffer + length, data, size_t(size));
+			length += size;
+		}
+		return *this;
+	}
+
+	static const int maxSize = 5 + 255 + 1; // Short APDU with data and Le
+	char buffer[maxSize];
+	int length = 0;
+	bool overflow = false;
+};
+
+// ISO 7816 file access shared by card reading and certificate updater
+class CardFile
+{
+public:
+	// Failed APDUs are retried with backoff of 25 and 50 ms before second and third attempt,
+	// unless stop flag is set meanwhile
+	static const int readAttempts = 3;
+	static const unsigned long readBackoff = 25;
+
+	static bool cardRemoved(const QPCSCReader::Result &result);
+	static QHash<quint8,QByteArray> parseFCI(const QByteArray &data);
+	static QByteArray readBinary(QPCSCReader *reader, int size, QByteArray data = QByteArray(),
+		const volatile bool *stop = nullptr);
+	static QPCSCReader::Result transfer(QPCSCReader *reader, const Apdu &apdu);
+};
@@ -0,0 +1,155 @@
+/*
+ * QEstEidUtil
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "Executor.h"
+
+#include <QtCore/QDebug>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QHash>
+#include <QtCore/QMutex>
+#include <QtCore/QQueue>
+#include <QtCore/QRunnable>
+#include <QtCore/QThread>
+#include <QtCore/QThreadPool>
+
+class ExecutorPrivate
+{
+public:
+	struct Stats
+	{
+		int depth = 0, maxDepth = 0; // Waiting tasks
+		quint64 tasks = 0, started = 0;
+		qint64 totalWait = 0, maxWait = 0; // ms from submit to start
+	};
+	struct Task
+	{
+		std::function<void ()> run;
+		QFutureInterface<void> result;
+		QElapsedTimer queued;
+	};
+	struct Queue
+	{
+		QQueue<Task> tasks;
+		bool running = false;
+		Stats stats;
+	};
+
+	class Runner: public QRunnable
+	{
+	public:
+		Runner(ExecutorPrivate *d, const QString &name): d(d), name(name) {}
+		void run() override;
+
+	private:
+		ExecutorPrivate *d;
+		QString name;
+	};
+
+	bool next(const QString &name, Task &task);
+
+	// Slow tasks are logged, APDUs and network requests should start at once
+	static const qint64 slowWait = 100;
+
+	QThreadPool pool;
+	mutable QMutex m;
+	QHash<QString,Queue> queues;
+};
+
+void ExecutorPrivate::Runner::run()
+{
+	// Drain queue on this thread, tasks of one queue never overlap
+	Task task;
+	while(d->next(name, task))
+	{
+		if(!task.result.isCanceled())
+			task.run();
+		task.result.reportFinished();
+	}
+}
+
+bool ExecutorPrivate::next(const QString &name, Task &task)
+{
+	QMutexLocker locker(&m);
+	Queue &q = queues[name];
+	if(q.tasks.isEmpty())
+	{
+		q.running = false;
+		return false;
+	}
+	task = q.tasks.dequeue();
+	qint64 wait = task.queued.elapsed();
+	q.stats.depth = q.tasks.size();
+	++q.stats.started;
+	q.stats.totalWait += wait;
+	q.stats.maxWait = qMax(q.stats.maxWait, wait);
+	if(wait > slowWait)
+		qDebug() << "Task in queue" << name << "waited" << wait << "ms, depth" << q.stats.depth
+			<< "max depth" << q.stats.maxDepth << "tasks" << q.stats.tasks
+			<< "average wait" << q.stats.totalWait / qint64(q.stats.started) << "ms max wait" << q.stats.maxWait << "ms";
+	return true;
+}
+
+
+
+Executor::Executor()
+	: d(new ExecutorPrivate)
+{
+	// PinPad tasks block a thread while user enters PIN, keep a few spare
+	d->pool.setMaxThreadCount(qBound(4, QThread::idealThreadCount(), 8));
+}
+
+Executor::~Executor()
+{
+	d->pool.waitForDone();
+	delete d;
+}
+
+Executor& Executor::instance()
+{
+	static Executor executor;
+	return executor;
+}
+
+QFuture<void> Executor::submit(const QString &queue, const std::function<void ()> &task)
+{
+	ExecutorPrivate::Task t;
+	t.run = task;
+	t.result.reportStarted();
+	t.queued.start();
+	QFuture<void> future = t.result.future();
+
+	QMutexLocker locker(&d->m);
+	ExecutorPrivate::Queue &q = d->queues[queue];
+	q.tasks.enqueue(t);
+	q.stats.depth = q.tasks.size();
+	q.stats.maxDepth = qMax(q.stats.maxDepth, q.stats.depth);
+	++q.stats.tasks;
+	// Unnamed tasks run in parallel, each gets own runner
+	if(queue.isEmpty() || !q.running)
+	{
+		q.running = true;
+		d->pool.start(new ExecutorPrivate::Runner(d, queue));
+	}
+	return future;
+}
+
+void Executor::waitForDone()
+{
+	d->pool.waitForDone();
+}
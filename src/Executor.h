@@ -0,0 +1,64 @@
+/*
+ * QEstEidUtil
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#pragma once
+
+#include <QtCore/QFuture>
+#include <QtCore/QString>
+
+#include <functional>
+
+class ExecutorPrivate;
+/*
+ * Application wide bounded thread pool.
+ * Tasks with same queue name, e.g. reader name, run one at a time in submit order,
+ * tasks without queue name run in parallel.
+ * Tasks canceled through their future before they start are dropped.
+ * Tasks waiting long for their queue are logged with queue statistics.
+ */
+class Executor
+{
+public:
+	static Executor& instance();
+
+	QFuture<void> submit(const QString &queue, const std::function<void ()> &task);
+	template<class T>
+	QFuture<T> run(const QString &queue, const std::function<T ()> &task);
+	void waitForDone();
+
+private:
+	Executor();
+	~Executor();
+	Q_DISABLE_COPY(Executor)
+
+	ExecutorPrivate *d;
+};
+
+template<class T>
+QFuture<T> Executor::run(const QString &queue, const std::function<T ()> &task)
+{
+	QFutureInterface<T> result;
+	result.reportStarted();
+	submit(queue, [=]() mutable {
+		if(!result.isCanceled())
+			result.reportResult(task());
+		result.reportFinished();
+	});
+	return result.future();
+}
@@ -45,6 +45,7 @@ class MacMenuBar;
 #endif
 
 #include <QtCore/QDate>
+#include <QtCore/QFutureWatcher>
 #include <QtCore/QStandardPaths>
 #include <QtCore/QTextStream>
 #include <QtCore/QTranslator>
@@ -56,6 +57,8 @@ class MacMenuBar;
 #include <QtWidgets/QFileDialog>
 #include <QtWidgets/QMessageBox>
 
+#include <functional>
+
 Q_DECLARE_METATYPE(MobileStatus)
 Q_DECLARE_METATYPE(Emails)
 
@@ -70,9 +73,12 @@ public:
 	QByteArray sendRequest( SSLConnect::RequestType type, const QString &param = QString() );
 	void showLoading( const QString &text );
 	void showWarning( const QString &msg, const QString &details = QString() );
+	void updateCardList( const QSmartCardData &t );
+	void updateCounters( const QSmartCardData &t );
 	void updateMobileStatusText( const QVariant &data, bool set );
 	bool validateCardError( QSmartCardData::PinType type, int flags, QSmartCard::ErrorType err );
 	bool validatePin( QSmartCardData::PinType type, bool puk, const QString &old, const QString &pin, const QString &pin2 );
+	void whenDone( const QFuture<QSmartCard::ErrorType> &future, const std::function<void (QSmartCard::ErrorType)> &done );
 
 	::MainWindow *q_ptr = nullptr;
 	QTranslator appTranslator, qtTranslator, commonTranslator;
@@ -81,6 +87,7 @@ public:
 	QLabel *loading = nullptr;
 	QPushButton *loadPicture = nullptr, *savePicture = nullptr;
 	QButtonGroup *b = nullptr;
+	int pending = 0; // Card operations in flight, loading is hidden by whenDone
 };
 
 
@@ -105,6 +112,20 @@ void MainWindowPrivate::clearPins()
 	}
 }
 
+void MainWindowPrivate::whenDone( const QFuture<QSmartCard::ErrorType> &future, const std::function<void (QSmartCard::ErrorType)> &done )
+{
+	// Loading stays visible until card operation has finished
+	++pending;
+	QFutureWatcher<QSmartCard::ErrorType> *watcher = new QFutureWatcher<QSmartCard::ErrorType>( q_ptr );
+	QObject::connect( watcher, &QFutureWatcherBase::finished, q_ptr, [=] {
+		done( watcher->result() );
+		if( --pending == 0 )
+			hideLoading();
+		watcher->deleteLater();
+	} );
+	watcher->setFuture( future );
+}
+
 void MainWindowPrivate::hideLoading()
 {
 	loading->hide();
@@ -164,6 +185,120 @@ void MainWindowPrivate::showWarning( const QString &msg, const QString &details
 	d.exec();
 }
 
+void MainWindowPrivate::updateCardList( const QSmartCardData &t )
+{
+	cards->clear();
+	cards->addItems( t.cards() );
+	cards->setVisible( t.cards().size() > 1 );
+	cards->setCurrentIndex( cards->findText( t.card() ) );
+}
+
+void MainWindowPrivate::updateCounters( const QSmartCardData &t )
+{
+	authInValidity->setVisible( t.retryCount( QSmartCardData::Pin1Type ) == 0 || !t.authCert().isValid() );
+	authValidity->setVisible( t.retryCount( QSmartCardData::Pin1Type ) > 0 && t.authCert().isValid() );
+	if ( t.retryCount( QSmartCardData::Pin1Type ) == 0 )
+		authInValidity->setText( t.authCert().isValid() ? tr("valid but blocked") : tr("invalid and blocked") );
+	else if( !t.authCert().isValid() )
+		authInValidity->setText( tr("expired") );
+	else
+		authValidity->setText( tr("valid and applicable") );
+
+	signInValidity->setVisible( t.retryCount( QSmartCardData::Pin2Type ) == 0 || !t.signCert().isValid() );
+	signValidity->setVisible( t.retryCount( QSmartCardData::Pin2Type ) > 0 && t.signCert().isValid() );
+	if( t.retryCount( QSmartCardData::Pin2Type ) == 0 )
+		signInValidity->setText( t.signCert().isValid() ? tr("valid but blocked") : tr("invalid and blocked") );
+	else if( !t.signCert().isValid() )
+		signInValidity->setText( tr("expired") );
+	else
+		signValidity->setText( tr("valid and applicable") );
+	// Certificates are read after counters, validity is unknown until then
+	if( t.authCert().isNull() )
+	{
+		authInValidity->hide();
+		authValidity->hide();
+	}
+	if( t.signCert().isNull() )
+	{
+		signInValidity->hide();
+		signValidity->hide();
+	}
+
+	authUsageCount->setText( tr( "Authentication key has been used %1 times" ).arg( t.usageCount( QSmartCardData::Pin1Type ) ) );
+	signUsageCount->setText( tr( "Signature key has been used %1 times" ).arg( t.usageCount( QSmartCardData::Pin2Type ) ) );
+	authUsageCount->setHidden( t.retryCount( QSmartCardData::Pin1Type ) == 0 );
+	signUsageCount->setHidden( t.retryCount( QSmartCardData::Pin2Type ) == 0 );
+
+	int authDays = std::max<int>( 0, QDateTime::currentDateTime().daysTo( t.authCert().expiryDate().toLocalTime() ) );
+	int signDays = std::max<int>( 0, QDateTime::currentDateTime().daysTo( t.signCert().expiryDate().toLocalTime() ) );
+	authCertExpired->setText( t.authCert().isValid() ?
+		tr("Certificate will expire in %1 days").arg( authDays ) : tr("Certificate is expired") );
+	signCertExpired->setText( t.signCert().isValid() ?
+		tr("Certificate will expire in %1 days").arg( signDays ) : tr("Certificate is expired") );
+	authCertExpired->setVisible( !t.authCert().isNull() && authDays <= 105 && t.retryCount( QSmartCardData::Pin1Type ) != 0 );
+	signCertExpired->setVisible( !t.signCert().isNull() && signDays <= 105 && t.retryCount( QSmartCardData::Pin2Type ) != 0 );
+
+	if( changePin1Info->currentWidget() == changePin1InfoPin )
+	{
+		changePin1AttemptsLable->setText( tr("Attempts left: %1").arg( t.retryCount( QSmartCardData::Pin1Type ) ) );
+		changePin1AttemptsLable->setVisible( t.retryCount( QSmartCardData::Pin1Type ) < THREE_ATTEMPTS );
+		changePin1PinpadAttemptsLable->setText( tr("Attempts left: %1").arg( t.retryCount( QSmartCardData::Pin1Type ) ) );
+		changePin1PinpadAttemptsLable->setVisible( t.retryCount( QSmartCardData::Pin1Type ) < THREE_ATTEMPTS );
+	}
+	if( changePin2Info->currentWidget() == changePin2InfoPin )
+	{
+		changePin2AttemptsLable->setText( tr("Attempts left: %1").arg( t.retryCount( QSmartCardData::Pin2Type ) ) );
+		changePin2AttemptsLable->setVisible( t.retryCount( QSmartCardData::Pin2Type ) < THREE_ATTEMPTS );
+		changePin2PinpadAttemptsLable->setText( tr("Attempts left: %1").arg( t.retryCount( QSmartCardData::Pin2Type ) ) );
+		changePin2PinpadAttemptsLable->setVisible( t.retryCount( QSmartCardData::Pin2Type ) < THREE_ATTEMPTS );
+	}
+	if( ( changePin1Info->currentWidget() != changePin1InfoPin ) &&
+		( changePin2Info->currentWidget() != changePin2InfoPin ) )
+	{
+		changePukAttemptsLable->setText( tr("Attempts left: %1").arg( t.retryCount( QSmartCardData::PukType ) ) );
+		changePukAttemptsLable->setVisible( t.retryCount( QSmartCardData::PukType ) < THREE_ATTEMPTS );
+		changePukPinpadAttemptsLable->setText( tr("Attempts left: %1").arg( t.retryCount( QSmartCardData::PukType ) ) );
+		changePukPinpadAttemptsLable->setVisible( t.retryCount( QSmartCardData::PukType ) < THREE_ATTEMPTS );
+	}
+
+	authChangePin->setVisible( t.retryCount( QSmartCardData::Pin1Type ) > 0 );
+	signChangePin->setVisible( t.retryCount( QSmartCardData::Pin2Type ) > 0 );
+	authCertBlocked->setHidden( t.retryCount( QSmartCardData::Pin1Type ) > 0 );
+	signCertBlocked->setHidden( t.retryCount( QSmartCardData::Pin2Type ) > 0 );
+	authRevoke->setVisible(
+		t.retryCount( QSmartCardData::Pin1Type ) == 0 && t.retryCount( QSmartCardData::PukType ) > 0 );
+	signRevoke->setVisible(
+		t.retryCount( QSmartCardData::Pin2Type ) == 0 && t.retryCount( QSmartCardData::PukType ) > 0 );
+
+	certUpdate->setProperty("updateEnabled",
+		Settings(qApp->applicationName()).value("updateButton", false).toBool() ||
+		(
+			t.version() >= QSmartCardData::VER_3_4 &&
+			t.retryCount( QSmartCardData::Pin1Type ) > 0 &&
+			t.isValid() && !t.authCert().isNull() && (
+				Configuration::instance().object().contains("EIDUPDATER-URL") ||
+				(t.version() == QSmartCardData::VER_3_4 && Configuration::instance().object().contains("EIDUPDATER-URL-34")) ||
+				(t.version() >= QSmartCardData::VER_3_5 && Configuration::instance().object().contains("EIDUPDATER-URL-35"))
+			) && (
+				!t.authCert().validateEncoding() ||
+				!t.signCert().validateEncoding() ||
+				t.version() & QSmartCardData::VER_HASUPDATER ||
+				t.version() == QSmartCardData::VER_USABLEUPDATER ||
+				(Configuration::instance().object().contains("EIDUPDATER-SHA1") && (
+					t.authCert().signatureAlgorithm() == "sha1WithRSAEncryption" ||
+					t.signCert().signatureAlgorithm() == "sha1WithRSAEncryption")
+				)
+			)
+		)
+	);
+	certUpdate->setVisible(certUpdate->property("updateEnabled").toBool());
+
+	pukLocked->setVisible( t.retryCount( QSmartCardData::PukType ) == 0 );
+	pukChange->setVisible( t.retryCount( QSmartCardData::PukType ) > 0 );
+	pukLink1->setVisible( !t.isSecurePinpad() && t.retryCount( QSmartCardData::PukType ) > 0 );
+	pukLink2->setVisible( !t.isSecurePinpad() && t.retryCount( QSmartCardData::PukType ) > 0 );
+}
+
 void MainWindowPrivate::updateMobileStatusText( const QVariant &data, bool set )
 {
 	if( set )
@@ -392,7 +527,7 @@ MainWindow::MainWindow( QWidget *parent )
 #endif
 
 	d->smartcard = new QSmartCard( this );
-	connect( d->smartcard, SIGNAL(dataChanged()), SLOT(updateData()) );
+	connect( d->smartcard, SIGNAL(dataChanged(QSmartCard::Changes)), SLOT(updateData(QSmartCard::Changes)) );
 	d->smartcard->start();
 	connect( d->cards, SIGNAL(activated(QString)), d->smartcard, SLOT(selectCard(QString)), Qt::QueuedConnection );
 
@@ -413,6 +548,17 @@ MainWindow::~MainWindow()
 	delete d;
 }
 
+void MainWindow::changeEvent(QEvent *event)
+{
+	// Card is refreshed less often while window is minimized
+	if(event->type() == QEvent::WindowStateChange && d->smartcard)
+		d->smartcard->setActive(isVisible() && !isMinimized());
+	// Card may have been used by other applications meanwhile
+	if(event->type() == QEvent::ActivationChange && d->smartcard && isActiveWindow())
+		d->smartcard->refresh();
+	QWidget::changeEvent(event);
+}
+
 bool MainWindow::eventFilter(QObject *obj, QEvent *event)
 {
 	if(obj != d->buttonCert || event->type() != QEvent::Paint || !d->certUpdate->property("updateEnabled").toBool())
@@ -436,6 +582,20 @@ bool MainWindow::eventFilter(QObject *obj, QEvent *event)
 	return true;
 }
 
+void MainWindow::hideEvent(QHideEvent *event)
+{
+	if(d->smartcard)
+		d->smartcard->setActive(false);
+	QWidget::hideEvent(event);
+}
+
+void MainWindow::showEvent(QShowEvent *event)
+{
+	if(d->smartcard)
+		d->smartcard->setActive(!isMinimized());
+	QWidget::showEvent(event);
+}
+
 void MainWindow::on_languages_activated( int index )
 {
 	QSmartCardData t = d->smartcard->data();
@@ -602,22 +762,27 @@ void MainWindow::setDataPage( int index )
 		d->loadPicture->setFocus();
 		break;
 	case PageCertAuthView:
+		d->smartcard->loadCertificates();
 		CertificateDialog( d->smartcard->data().authCert(), this ).exec();
 		break;
 	case PageCertSignView:
+		d->smartcard->loadCertificates();
 		CertificateDialog( d->smartcard->data().signCert(), this ).exec();
 		break;
 	case PageCertUpdate:
 	{
+		d->smartcard->loadCertificates();
 #ifdef Q_OS_WIN
 		CertStore s;
 		s.remove(d->smartcard->data().authCert());
 		s.remove(d->smartcard->data().signCert());
 #endif
 		d->showLoading( tr("Updating certificates") );
-		d->smartcard->d->m.lock();
-		Updater(d->smartcard->data().reader(), this).exec();
-		d->smartcard->d->m.unlock();
+		const QString reader = d->smartcard->data().reader();
+		d->smartcard->d->lock(reader, QSmartCardPrivate::Interactive);
+		d->smartcard->d->queue(reader)->session.clear(); // Updater connects exclusively
+		Updater(reader, this).exec();
+		d->smartcard->d->unlock(reader);
 		d->smartcard->reload();
 		break;
 	}
@@ -770,14 +935,16 @@ void MainWindow::setDataPage( int index )
 			d->showLoading( tr("Enter PIN/PUK codes on PinPad") );
 		else
 			d->showLoading( tr("Changing %1 code").arg( QSmartCardData::typeString( QSmartCardData::Pin1Type ) ) );
-		if( d->validateCardError( QSmartCardData::Pin1Type, 1024,
-				d->smartcard->change( QSmartCardData::Pin1Type, d->changePin1New->text(), d->changePin1Validate->text() ) ) )
-		{
-			QMessageBox::information( this, windowTitle(), tr("%1 changed!").arg( QSmartCardData::typeString( QSmartCardData::Pin1Type ) ) );
-			setDataPage( PageCert );
-		}
+		d->whenDone( d->smartcard->changeAsync( QSmartCardData::Pin1Type, d->changePin1New->text(), d->changePin1Validate->text() ),
+			[=]( QSmartCard::ErrorType err ) {
+			if( d->validateCardError( QSmartCardData::Pin1Type, 1024, err ) )
+			{
+				QMessageBox::information( this, windowTitle(), tr("%1 changed!").arg( QSmartCardData::typeString( QSmartCardData::Pin1Type ) ) );
+				setDataPage( PageCert );
+			}
+		} );
 		d->clearPins();
-		break;
+		return;
 	case PagePin1ChangePuk:
 	case PagePin1ChangeUnblock:
 		if( !t.isPinpad() && !d->validatePin( QSmartCardData::Pin1Type, true,
@@ -797,28 +964,30 @@ void MainWindow::setDataPage( int index )
 		else
 			d->showLoading( tr("Enter PIN/PUK codes on PinPad") );
 
-		if( d->validateCardError( QSmartCardData::Pin1Type, 1025,
-				d->smartcard->unblock( QSmartCardData::Pin1Type, d->changePin1New->text(), d->changePin1Validate->text() ) ) )
-		{
-			if( index == PagePin1ChangePuk )
-				QMessageBox::information( this, windowTitle(), tr("%1 changed!")
-					.arg( QSmartCardData::typeString( QSmartCardData::Pin1Type ) ) );
+		d->whenDone( d->smartcard->unblockAsync( QSmartCardData::Pin1Type, d->changePin1New->text(), d->changePin1Validate->text() ),
+			[=]( QSmartCard::ErrorType err ) {
+			if( d->validateCardError( QSmartCardData::Pin1Type, 1025, err ) )
+			{
+				if( index == PagePin1ChangePuk )
+					QMessageBox::information( this, windowTitle(), tr("%1 changed!")
+						.arg( QSmartCardData::typeString( QSmartCardData::Pin1Type ) ) );
+				else
+					QMessageBox::information( this, windowTitle(), tr("%1 has been changed and the certificate has been unblocked!")
+						.arg( QSmartCardData::typeString( QSmartCardData::Pin1Type ) ) );
+				updateData();
+				setDataPage( PageCert );
+			}
 			else
-				QMessageBox::information( this, windowTitle(), tr("%1 has been changed and the certificate has been unblocked!")
-					.arg( QSmartCardData::typeString( QSmartCardData::Pin1Type ) ) );
-			updateData();
-			setDataPage( PageCert );
-		}
-		else
-		{
-			t = d->smartcard->data();	// refresh modified object's data
-			d->changePin1AttemptsLable->setText( tr("Attempts left: %1").arg( t.retryCount( QSmartCardData::PukType ) ) );
-			d->changePin1AttemptsLable->setVisible( t.retryCount( QSmartCardData::PukType ) < THREE_ATTEMPTS );
-			d->changePin1PinpadAttemptsLable->setText( tr("Attempts left: %1").arg( t.retryCount( QSmartCardData::PukType ) ) );
-			d->changePin1PinpadAttemptsLable->setVisible( t.retryCount( QSmartCardData::PukType ) < THREE_ATTEMPTS );
-		}
+			{
+				QSmartCardData t = d->smartcard->data();	// refresh modified object's data
+				d->changePin1AttemptsLable->setText( tr("Attempts left: %1").arg( t.retryCount( QSmartCardData::PukType ) ) );
+				d->changePin1AttemptsLable->setVisible( t.retryCount( QSmartCardData::PukType ) < THREE_ATTEMPTS );
+				d->changePin1PinpadAttemptsLable->setText( tr("Attempts left: %1").arg( t.retryCount( QSmartCardData::PukType ) ) );
+				d->changePin1PinpadAttemptsLable->setVisible( t.retryCount( QSmartCardData::PukType ) < THREE_ATTEMPTS );
+			}
+		} );
 		d->clearPins();
-		break;
+		return;
 	case PagePin2Pin:
 		d->changePin2Info->setCurrentWidget( d->changePin2InfoPin );
 		d->changePin2PinpadInfo->setCurrentWidget( d->changePin2PinpadInfoPin );
@@ -872,14 +1041,16 @@ void MainWindow::setDataPage( int index )
 			d->showLoading( tr("Enter PIN/PUK codes on PinPad") );
 		else
 			d->showLoading( tr("Changing %1 code").arg( QSmartCardData::typeString( QSmartCardData::Pin2Type ) ) );
-		if( d->validateCardError( QSmartCardData::Pin2Type, 1024,
-				d->smartcard->change( QSmartCardData::Pin2Type, d->changePin2New->text(), d->changePin2Validate->text() ) ) )
-		{
-			QMessageBox::information( this, windowTitle(), tr("%1 changed!").arg( QSmartCardData::typeString( QSmartCardData::Pin2Type ) ) );
-			setDataPage( PageCert );
-		}
+		d->whenDone( d->smartcard->changeAsync( QSmartCardData::Pin2Type, d->changePin2New->text(), d->changePin2Validate->text() ),
+			[=]( QSmartCard::ErrorType err ) {
+			if( d->validateCardError( QSmartCardData::Pin2Type, 1024, err ) )
+			{
+				QMessageBox::information( this, windowTitle(), tr("%1 changed!").arg( QSmartCardData::typeString( QSmartCardData::Pin2Type ) ) );
+				setDataPage( PageCert );
+			}
+		} );
 		d->clearPins();
-		break;
+		return;
 	case PagePin2ChangePuk:
 	case PagePin2ChangeUnblock:
 		if( !t.isPinpad() && !d->validatePin( QSmartCardData::Pin2Type, true,
@@ -899,28 +1070,30 @@ void MainWindow::setDataPage( int index )
 		else
 			d->showLoading( tr("Enter PIN/PUK codes on PinPad") );
 
-		if( d->validateCardError( QSmartCardData::Pin2Type, 1025,
-				d->smartcard->unblock( QSmartCardData::Pin2Type, d->changePin2New->text(), d->changePin2Validate->text() ) ) )
-		{
-			if( index == PagePin2ChangePuk )
-				QMessageBox::information( this, windowTitle(), tr("%1 changed!")
-					.arg( QSmartCardData::typeString( QSmartCardData::Pin2Type ) ) );
+		d->whenDone( d->smartcard->unblockAsync( QSmartCardData::Pin2Type, d->changePin2New->text(), d->changePin2Validate->text() ),
+			[=]( QSmartCard::ErrorType err ) {
+			if( d->validateCardError( QSmartCardData::Pin2Type, 1025, err ) )
+			{
+				if( index == PagePin2ChangePuk )
+					QMessageBox::information( this, windowTitle(), tr("%1 changed!")
+						.arg( QSmartCardData::typeString( QSmartCardData::Pin2Type ) ) );
+				else
+					QMessageBox::information( this, windowTitle(), tr("%1 has been changed and the certificate has been unblocked!")
+						.arg( QSmartCardData::typeString( QSmartCardData::Pin2Type ) ) );
+				updateData();
+				setDataPage( PageCert );
+			}
 			else
-				QMessageBox::information( this, windowTitle(), tr("%1 has been changed and the certificate has been unblocked!")
-					.arg( QSmartCardData::typeString( QSmartCardData::Pin2Type ) ) );
-			updateData();
-			setDataPage( PageCert );
-		}
-		else
-		{
-			t = d->smartcard->data();	// refresh modified object's data
-			d->changePin2AttemptsLable->setText( tr("Attempts left: %1").arg( t.retryCount( QSmartCardData::PukType ) ) );
-			d->changePin2AttemptsLable->setVisible( t.retryCount( QSmartCardData::PukType ) < THREE_ATTEMPTS );
-			d->changePin2PinpadAttemptsLable->setText( tr("Attempts left: %1").arg( t.retryCount( QSmartCardData::PukType ) ) );
-			d->changePin2PinpadAttemptsLable->setVisible( t.retryCount( QSmartCardData::PukType ) < THREE_ATTEMPTS );
-		}
+			{
+				QSmartCardData t = d->smartcard->data();	// refresh modified object's data
+				d->changePin2AttemptsLable->setText( tr("Attempts left: %1").arg( t.retryCount( QSmartCardData::PukType ) ) );
+				d->changePin2AttemptsLable->setVisible( t.retryCount( QSmartCardData::PukType ) < THREE_ATTEMPTS );
+				d->changePin2PinpadAttemptsLable->setText( tr("Attempts left: %1").arg( t.retryCount( QSmartCardData::PukType ) ) );
+				d->changePin2PinpadAttemptsLable->setVisible( t.retryCount( QSmartCardData::PukType ) < THREE_ATTEMPTS );
+			}
+		} );
 		d->clearPins();
-		break;
+		return;
 	case PagePuk:
 		d->changePukValidate->setFocus();
 		d->changePukAttemptsLable->setText( tr("Attempts left: %1").arg( t.retryCount( QSmartCardData::PukType ) ) );
@@ -939,14 +1112,16 @@ void MainWindow::setDataPage( int index )
 			d->showLoading( tr("Enter PIN/PUK codes on PinPad") );
 		else
 			d->showLoading( tr("Changing %1 code").arg( QSmartCardData::typeString( QSmartCardData::PukType ) ) );
-		if( d->validateCardError( QSmartCardData::PukType, 1024,
-				d->smartcard->change( QSmartCardData::PukType, d->changePukNew->text(), d->changePukValidate->text() ) ) )
-		{
-			QMessageBox::information( this, windowTitle(), tr("%1 changed!").arg( QSmartCardData::typeString( QSmartCardData::PukType ) ) );
-			setDataPage( PageCert );
-		}
+		d->whenDone( d->smartcard->changeAsync( QSmartCardData::PukType, d->changePukNew->text(), d->changePukValidate->text() ),
+			[=]( QSmartCard::ErrorType err ) {
+			if( d->validateCardError( QSmartCardData::PukType, 1024, err ) )
+			{
+				QMessageBox::information( this, windowTitle(), tr("%1 changed!").arg( QSmartCardData::typeString( QSmartCardData::PukType ) ) );
+				setDataPage( PageCert );
+			}
+		} );
 		d->clearPins();
-		break;
+		return;
 	default: break;
 	}
 	d->hideLoading();
@@ -974,7 +1149,8 @@ void MainWindow::showWarning( const QString &msg )
 
 void MainWindow::updateData()
 {
-	d->hideLoading();
+	if( !d->pending )
+		d->hideLoading();
 	QSmartCardData t = d->smartcard->data();
 
 	if( !t.isNull() )
@@ -985,7 +1161,7 @@ void MainWindow::updateData()
 		st << "<font style='color: #54859b;'><font style='font-weight: bold; font-size: 16px;'>"
 		   << tr("Card in reader") << " <font style='color: black;'>"
 		   << t.data( QSmartCardData::DocumentId ).toString() << "</font></font><br />";
-		if( t.authCert().type() & SslCertificate::EstEidType )
+		if( t.authCert().isNull() || t.authCert().type() & SslCertificate::EstEidType )
 		{
 			st << tr("This is");
 			if( t.isValid() )
@@ -1033,70 +1209,7 @@ void MainWindow::updateData()
 
 		d->authTill->setText( DateTime( t.authCert().expiryDate().toLocalTime() ).formatDate( "dd. MMMM yyyy" ) );
 		d->signTill->setText( DateTime( t.signCert().expiryDate().toLocalTime() ).formatDate( "dd. MMMM yyyy" ) );
-
-		d->authInValidity->setVisible( t.retryCount( QSmartCardData::Pin1Type ) == 0 || !t.authCert().isValid() );
-		d->authValidity->setVisible( t.retryCount( QSmartCardData::Pin1Type ) > 0 && t.authCert().isValid() );
-		if ( t.retryCount( QSmartCardData::Pin1Type ) == 0 )
-			d->authInValidity->setText( t.authCert().isValid() ? tr("valid but blocked") : tr("invalid and blocked") );
-		else if( !t.authCert().isValid() )
-			d->authInValidity->setText( tr("expired") );
-		else
-			d->authValidity->setText( tr("valid and applicable") );
-
-		d->signInValidity->setVisible( t.retryCount( QSmartCardData::Pin2Type ) == 0 || !t.signCert().isValid() );
-		d->signValidity->setVisible( t.retryCount( QSmartCardData::Pin2Type ) > 0 && t.signCert().isValid() );
-		if( t.retryCount( QSmartCardData::Pin2Type ) == 0 )
-			d->signInValidity->setText( t.signCert().isValid() ? tr("valid but blocked") : tr("invalid and blocked") );
-		else if( !t.signCert().isValid() )
-			d->signInValidity->setText( tr("expired") );
-		else
-			d->signValidity->setText( tr("valid and applicable") );
-
-		d->authUsageCount->setText( tr( "Authentication key has been used %1 times" ).arg( t.usageCount( QSmartCardData::Pin1Type ) ) );
-		d->signUsageCount->setText( tr( "Signature key has been used %1 times" ).arg( t.usageCount( QSmartCardData::Pin2Type ) ) );
-		d->authUsageCount->setHidden( t.retryCount( QSmartCardData::Pin1Type ) == 0 );
-		d->signUsageCount->setHidden( t.retryCount( QSmartCardData::Pin2Type ) == 0 );
-
-		int authDays = std::max<int>( 0, QDateTime::currentDateTime().daysTo( t.authCert().expiryDate().toLocalTime() ) );
-		int signDays = std::max<int>( 0, QDateTime::currentDateTime().daysTo( t.signCert().expiryDate().toLocalTime() ) );
-		d->authCertExpired->setText( t.authCert().isValid() ?
-			tr("Certificate will expire in %1 days").arg( authDays ) : tr("Certificate is expired") );
-		d->signCertExpired->setText( t.signCert().isValid() ?
-			tr("Certificate will expire in %1 days").arg( signDays ) : tr("Certificate is expired") );
-		d->authCertExpired->setVisible( authDays <= 105 && t.retryCount( QSmartCardData::Pin1Type ) != 0 );
-		d->signCertExpired->setVisible( signDays <= 105 && t.retryCount( QSmartCardData::Pin2Type ) != 0 );
-
-		if( d->changePin1Info->currentWidget() == d->changePin1InfoPin )
-		{
-			d->changePin1AttemptsLable->setText( tr("Attempts left: %1").arg( t.retryCount( QSmartCardData::Pin1Type ) ) );
-			d->changePin1AttemptsLable->setVisible( t.retryCount( QSmartCardData::Pin1Type ) < THREE_ATTEMPTS );
-			d->changePin1PinpadAttemptsLable->setText( tr("Attempts left: %1").arg( t.retryCount( QSmartCardData::Pin1Type ) ) );
-			d->changePin1PinpadAttemptsLable->setVisible( t.retryCount( QSmartCardData::Pin1Type ) < THREE_ATTEMPTS );
-		}
-		if( d->changePin2Info->currentWidget() == d->changePin2InfoPin )
-		{
-			d->changePin2AttemptsLable->setText( tr("Attempts left: %1").arg( t.retryCount( QSmartCardData::Pin2Type ) ) );
-			d->changePin2AttemptsLable->setVisible( t.retryCount( QSmartCardData::Pin2Type ) < THREE_ATTEMPTS );
-			d->changePin2PinpadAttemptsLable->setText( tr("Attempts left: %1").arg( t.retryCount( QSmartCardData::Pin2Type ) ) );
-			d->changePin2PinpadAttemptsLable->setVisible( t.retryCount( QSmartCardData::Pin2Type ) < THREE_ATTEMPTS );
-		}
-		if( ( d->changePin1Info->currentWidget() != d->changePin1InfoPin ) &&
-			( d->changePin2Info->currentWidget() != d->changePin2InfoPin ) )
-		{
-			d->changePukAttemptsLable->setText( tr("Attempts left: %1").arg( t.retryCount( QSmartCardData::PukType ) ) );
-			d->changePukAttemptsLable->setVisible( t.retryCount( QSmartCardData::PukType ) < THREE_ATTEMPTS );
-			d->changePukPinpadAttemptsLable->setText( tr("Attempts left: %1").arg( t.retryCount( QSmartCardData::PukType ) ) );
-			d->changePukPinpadAttemptsLable->setVisible( t.retryCount( QSmartCardData::PukType ) < THREE_ATTEMPTS );
-		}
-
-		d->authChangePin->setVisible( t.retryCount( QSmartCardData::Pin1Type ) > 0 );
-		d->signChangePin->setVisible( t.retryCount( QSmartCardData::Pin2Type ) > 0 );
-		d->authCertBlocked->setHidden( t.retryCount( QSmartCardData::Pin1Type ) > 0 );
-		d->signCertBlocked->setHidden( t.retryCount( QSmartCardData::Pin2Type ) > 0 );
-		d->authRevoke->setVisible(
-			t.retryCount( QSmartCardData::Pin1Type ) == 0 && t.retryCount( QSmartCardData::PukType ) > 0 );
-		d->signRevoke->setVisible(
-			t.retryCount( QSmartCardData::Pin2Type ) == 0 && t.retryCount( QSmartCardData::PukType ) > 0 );
+		d->updateCounters( t );
 		d->authFrame->setVisible( !t.authCert().isNull() );
 		d->signFrame->setVisible( !t.signCert().isNull() );
 		d->certsLine->setVisible( !t.authCert().isNull() || !t.signCert().isNull() );
@@ -1104,33 +1217,6 @@ void MainWindow::updateData()
 		d->buttonMobile->setDisabled(t.version() == QSmartCardData::VER_USABLEUPDATER);
 		d->buttonPuk->setDisabled(t.version() == QSmartCardData::VER_USABLEUPDATER);
 
-		d->certUpdate->setProperty("updateEnabled",
-			Settings(qApp->applicationName()).value("updateButton", false).toBool() ||
-			(
-				t.version() >= QSmartCardData::VER_3_4 &&
-				t.retryCount( QSmartCardData::Pin1Type ) > 0 &&
-				t.isValid() && (
-					Configuration::instance().object().contains("EIDUPDATER-URL") ||
-					(t.version() == QSmartCardData::VER_3_4 && Configuration::instance().object().contains("EIDUPDATER-URL-34")) ||
-					(t.version() >= QSmartCardData::VER_3_5 && Configuration::instance().object().contains("EIDUPDATER-URL-35"))
-				) && (
-					!t.authCert().validateEncoding() ||
-					!t.signCert().validateEncoding() ||
-					t.version() & QSmartCardData::VER_HASUPDATER ||
-					t.version() == QSmartCardData::VER_USABLEUPDATER ||
-					(Configuration::instance().object().contains("EIDUPDATER-SHA1") && (
-						t.authCert().signatureAlgorithm() == "sha1WithRSAEncryption" ||
-						t.signCert().signatureAlgorithm() == "sha1WithRSAEncryption")
-					)
-				)
-			)
-		);
-		d->certUpdate->setVisible(d->certUpdate->property("updateEnabled").toBool());
-
-		d->pukLocked->setVisible( t.retryCount( QSmartCardData::PukType ) == 0 );
-		d->pukChange->setVisible( t.retryCount( QSmartCardData::PukType ) > 0 );
-		d->pukLink1->setVisible( !t.isSecurePinpad() && t.retryCount( QSmartCardData::PukType ) > 0 );
-		d->pukLink2->setVisible( !t.isSecurePinpad() && t.retryCount( QSmartCardData::PukType ) > 0 );
 		d->changePin1InfoPinLink->setHidden( t.isSecurePinpad() );
 		d->changePin2InfoPinLink->setHidden( t.isSecurePinpad() );
 
@@ -1152,11 +1238,13 @@ void MainWindow::updateData()
 
 #ifdef Q_OS_WIN
 		CertStore store;
-		if( !Settings().value( "Utility/showRegCert", false ).toBool() ||
+		// Registered when certificates arrive with CertificatesChanged
+		if( !t.authCert().isNull() && !t.signCert().isNull() && (
+			!Settings().value( "Utility/showRegCert", false ).toBool() ||
 			(!store.find( t.authCert() ) || !store.find( t.signCert() )) &&
 			QMessageBox::question( this, tr( "Certificate store" ),
 				tr( "Certificate is not registered in the certificate store. Register now?" ),
-				QMessageBox::Yes | QMessageBox::No, QMessageBox::Yes ) == QMessageBox::Yes )
+				QMessageBox::Yes | QMessageBox::No, QMessageBox::Yes ) == QMessageBox::Yes ) )
 		{
 			QString personalCode = t.authCert().subjectInfo( "serialNumber" );
 			for( const SslCertificate &c: store.list())
@@ -1207,9 +1295,19 @@ void MainWindow::updateData()
 	d->loadPicture->setVisible( !t.authCert().isNull() && d->pictureFrame->property("PICTURE").isNull() );
 	d->savePicture->setHidden(d->pictureFrame->property("PICTURE").isNull() ||
 		Settings(QSettings::SystemScope).value("disableSave", false).toBool());
+	d->updateCardList( t );
+}
 
-	d->cards->clear();
-	d->cards->addItems( t.cards() );
-	d->cards->setVisible( t.cards().size() > 1 );
-	d->cards->setCurrentIndex( d->cards->findText( t.card() ) );
+void MainWindow::updateData( QSmartCard::Changes changes )
+{
+	// Counters and lists are refreshed without rebuilding whole card info
+	QSmartCardData t = d->smartcard->data();
+	if( t.isNull() || changes & ~(QSmartCard::ReaderListChanged|QSmartCard::CardListChanged|QSmartCard::CountersChanged) )
+		return updateData();
+	if( !d->pending )
+		d->hideLoading();
+	if( changes & QSmartCard::CountersChanged )
+		d->updateCounters( t );
+	if( changes & QSmartCard::CardListChanged )
+		d->updateCardList( t );
 }
@@ -19,6 +19,8 @@
 
 #pragma once
 
+#include "QSmartCard.h"
+
 #include <QtWidgets/QWidget>
 
 #define THREE_ATTEMPTS	3		// user has three attempts to enter a correct PIN1/PIN2/PUK code
@@ -88,9 +90,13 @@ private slots:
 	void showSettings();
 	void showWarning( const QString &msg );
 	void updateData();
+	void updateData( QSmartCard::Changes changes );
 
 private:
+	void changeEvent(QEvent *event);
 	bool eventFilter(QObject *obj, QEvent *event);
+	void hideEvent(QHideEvent *event);
+	void showEvent(QShowEvent *event);
 	MainWindowPrivate *d;
 	QString lang;
 
@@ -19,18 +19,161 @@
 
 #include "QSmartCard_p.h"
 
+#include "Executor.h"
+
 #include <common/IKValidator.h>
 #include <common/PinDialog.h>
 #include <common/Settings.h>
 
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QDataStream>
 #include <QtCore/QDateTime>
 #include <QtCore/QDebug>
+#include <QtCore/QDir>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QEventLoop>
+#include <QtCore/QFileInfo>
+#include <QtCore/QFutureWatcher>
+#include <QtCore/QMessageAuthenticationCode>
 #include <QtCore/QScopedPointer>
+#include <QtCore/QStandardPaths>
+#include <QtCore/QWaitCondition>
 #include <QtNetwork/QSslKey>
 #include <QtWidgets/QApplication>
 
 #include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#ifdef Q_OS_WIN
+#undef UNICODE
+#include <Windows.h>
+#include <winscard.h>
+#elif defined(Q_OS_MAC)
+#include <PCSC/wintypes.h>
+#include <PCSC/winscard.h>
+#else
+#include <winscard.h>
+#endif
+
+#include <atomic>
+#include <climits>
 #include <thread>
+#include <vector>
+
+// ATR in hex with optional mask of same length, bits cleared in mask are ignored like in
+// pcsc-lite and OpenSC ATR:mask entries. Matched on hex digits, lookup does not allocate.
+struct KnownATR
+{
+	const char *atr, *mask;
+	QSmartCardData::CardVersion version;
+};
+
+static constexpr KnownATR atrList[] = {
+	{"3BFE9400FF80B1FA451F034573744549442076657220312E3043", nullptr, QSmartCardData::VER_1_0}, /*ESTEID_V1_COLD_ATR*/
+	{"3B6E00FF4573744549442076657220312E30", nullptr, QSmartCardData::VER_1_0}, /*ESTEID_V1_WARM_ATR*/
+	{"3BDE18FFC080B1FE451F034573744549442076657220312E302B", nullptr, QSmartCardData::VER_1_0_2007}, /*ESTEID_V1_2007_COLD_ATR*/
+	{"3B5E11FF4573744549442076657220312E30", nullptr, QSmartCardData::VER_1_0_2007}, /*ESTEID_V1_2007_WARM_ATR*/
+	{"3B6E00004573744549442076657220312E30", nullptr, QSmartCardData::VER_1_1}, /*ESTEID_V1_1_COLD_ATR*/
+	{"3BFE1800008031FE454573744549442076657220312E30A8", nullptr, QSmartCardData::VER_3_4}, /*ESTEID_V3_COLD_DEV1_ATR*/
+	{"3BFE1800008031FE45803180664090A4561B168301900086", nullptr, QSmartCardData::VER_3_4}, /*ESTEID_V3_WARM_DEV1_ATR*/
+	{"3BFE1800008031FE45803180664090A4162A0083019000E1", nullptr, QSmartCardData::VER_3_4}, /*ESTEID_V3_WARM_DEV2_ATR*/
+	// ESTEID_V3_WARM_DEV3_ATR is same as ESTEID_V35_WARM_ATR, applet probe tells them apart
+	{"3BF9180000C00A31FE4553462D3443432D303181", nullptr, QSmartCardData::VER_3_5}, /*ESTEID_V35_COLD_DEV1_ATR*/
+	{"3BF81300008131FE454A434F5076323431B7", nullptr, QSmartCardData::VER_3_5}, /*ESTEID_V35_COLD_DEV2_ATR*/
+	{"3BFA1800008031FE45FE654944202F20504B4903", nullptr, QSmartCardData::VER_3_5}, /*ESTEID_V35_COLD_DEV3_ATR*/
+	{"3BFE1800008031FE45803180664090A4162A00830F9000EF", nullptr, QSmartCardData::VER_3_5}, /*ESTEID_V35_WARM_ATR*/
+	{"3BFE1800008031FE45803180664090A5102E03830F9000EF", nullptr, QSmartCardData::VER_3_5}, /*UPDATER_TEST_CARDS*/
+};
+static constexpr size_t atrCount = sizeof(atrList) / sizeof(atrList[0]);
+
+static constexpr bool sameATR(const char *a, const char *b)
+{
+	return *a == *b && (*a == 0 || sameATR(a + 1, b + 1));
+}
+
+static constexpr bool uniqueATR(size_t i = 0, size_t j = 1)
+{
+	return i >= atrCount ? true :
+		j >= atrCount ? uniqueATR(i + 1, i + 2) :
+		!sameATR(atrList[i].atr, atrList[j].atr) && uniqueATR(i, j + 1);
+}
+static_assert(uniqueATR(), "Duplicate ATR in atrList");
+
+static QSmartCardData::CardVersion cardVersion(const QByteArray &atr)
+{
+	for(const KnownATR &known: atrList)
+	{
+		if(qstrlen(known.atr) != uint(atr.size()))
+			continue;
+		bool match = true;
+		for(int i = 0; match && i < atr.size(); ++i)
+		{
+			int mask = known.mask ? hexValue(known.mask[i]) : 0xF;
+			match = (hexValue(atr[i]) & mask) == (hexValue(known.atr[i]) & mask);
+		}
+		if(match)
+			return known.version;
+	}
+	return QSmartCardData::VER_INVALID;
+}
+
+/**
+ * Blocks in SCardGetStatusChange until a card is inserted or removed,
+ * a reader is attached or detached, or cancel() is called.
+ */
+class QSmartCardWatcher
+{
+public:
+	QSmartCardWatcher() = default;
+	~QSmartCardWatcher();
+
+	void cancel();
+	bool isPending() const { return pending; }
+	quint32 state(const QString &reader) const;
+	bool wait(const QStringList &readers, unsigned long msec, unsigned long fallback = 5000);
+
+private:
+	bool establish();
+	void sleep(unsigned long msec);
+
+	// Event counter in high word and card presence, SCARD_STATE_INUSE and
+	// SCARD_STATE_EXCLUSIVE toggle on our own connects
+	static const DWORD mask = 0xFFFF0000|SCARD_STATE_UNKNOWN|SCARD_STATE_UNAVAILABLE|
+		SCARD_STATE_EMPTY|SCARD_STATE_PRESENT|SCARD_STATE_MUTE;
+
+	SCARDCONTEXT context = 0;
+	QHash<QString,DWORD> states;
+	DWORD pnp = SCARD_STATE_UNAWARE;
+	bool pnpSupported = false;
+	std::atomic<bool> pending{false}, waiting{false};
+	QMutex lock; // Guards context and waiting against cancel() from other threads
+	QWaitCondition wakeup, returned;
+};
+
+// Decides how long poller sleeps between rounds, backs off on errors and while idle
+class QSmartCardPolicy
+{
+public:
+	explicit QSmartCardPolicy(QSmartCardWatcher *watcher): watcher(watcher) {}
+
+	bool isActive() const { return active; }
+	void setActive(bool value);
+	void requestCounters();
+	void deferCounters() { countersDue = true; } // Retried next round without waking poller
+	bool takeCounters() { return countersDue.exchange(false); }
+	unsigned long poll(bool noReaders);
+	unsigned long retry(unsigned long msec);
+	void succeeded() { failures = 0; }
+	void wake();
+
+private:
+	static const unsigned long maximum = 120000;
+
+	QSmartCardWatcher *watcher;
+	std::atomic<bool> active{true}, countersDue{false};
+	std::atomic<int> failures{0};
+	int emptyRounds = 0; // Poller thread only
+};
 
 QSmartCardData::QSmartCardData(): d(new QSmartCardDataPrivate) {}
 QSmartCardData::QSmartCardData(const QSmartCardData &other): d(other.d) {}
@@ -40,93 +183,1188 @@ QSmartCardData& QSmartCardData::operator =(const QSmartCardData &other) { d = ot
 QString QSmartCardData::card() const { return d->card; }
 QStringList QSmartCardData::cards() const { return d->cards; }
 
-bool QSmartCardData::isNull() const
-{ return d->data.isEmpty() && d->authCert.isNull() && d->signCert.isNull(); }
+bool QSmartCardData::isNull() const { return !d->loaded; }
 bool QSmartCardData::isPinpad() const { return d->pinpad; }
 bool QSmartCardData::isSecurePinpad() const
 { return d->reader.contains("EZIO SHIELD", Qt::CaseInsensitive); }
 bool QSmartCardData::isValid() const
-{ return d->data.value(Expiry).toDateTime() >= QDateTime::currentDateTime(); }
+{ return d->value(Expiry).toDateTime() >= QDateTime::currentDateTime(); }
+
+QString QSmartCardData::reader() const { return d->reader; }
+QStringList QSmartCardData::readers() const { return d->readers; }
+
+QVariant QSmartCardData::data(PersonalDataType type) const
+{ return d->value(type); }
+SslCertificate QSmartCardData::authCert() const { return d->authCert; }
+SslCertificate QSmartCardData::signCert() const { return d->signCert; }
+quint8 QSmartCardData::retryCount(PinType type) const { return d->retry[size_t(type)]; }
+ulong QSmartCardData::usageCount(PinType type) const { return d->usage[size_t(type)]; }
+QSmartCardData::CardVersion QSmartCardData::version() const { return d->version; }
+
+QString QSmartCardData::typeString(QSmartCardData::PinType type)
+{
+	switch(type)
+	{
+	case Pin1Type: return "PIN1";
+	case Pin2Type: return "PIN2";
+	case PukType: return "PUK";
+	}
+	return "";
+}
+
+QSmartCardDataPrivate::QSmartCardDataPrivate(const QSmartCardDataPrivate &other)
+:	QSharedData(other)
+,	card(other.card)
+,	reader(other.reader)
+,	cards(other.cards)
+,	readers(other.readers)
+,	records(other.records)
+,	recordEnd(other.recordEnd)
+,	raw(other.raw)
+,	present(other.present)
+,	loaded(other.loaded)
+,	certsLoaded(other.certsLoaded)
+,	cached(other.cached)
+,	authCert(other.authCert)
+,	signCert(other.signCert)
+,	retry(other.retry)
+,	usage(other.usage)
+,	version(other.version)
+,	pinpad(other.pinpad)
+{
+	// Other may be decoding meanwhile in different thread
+	QMutexLocker locker(&other.decodeLock);
+	text = other.text;
+	dates = other.dates;
+	decoded = other.decoded;
+}
+
+int QSmartCardDataPrivate::dateIndex(QSmartCardData::PersonalDataType type)
+{
+	switch(type)
+	{
+	case QSmartCardData::BirthDate: return 0;
+	case QSmartCardData::Expiry: return 1;
+	case QSmartCardData::IssueDate: return 2;
+	default: return -1;
+	}
+}
+
+QString QSmartCardDataPrivate::fromCP1252(const QByteArray &data)
+{
+	// 0x80 - 0x9F differ from Latin-1, undefined bytes map to replacement character
+	static const ushort c1[] = {
+		0x20AC, 0xFFFD, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+		0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0xFFFD, 0x017D, 0xFFFD,
+		0xFFFD, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+		0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0xFFFD, 0x017E, 0x0178 };
+	QString result(data.size(), Qt::Uninitialized);
+	QChar *out = result.data();
+	for(const char c: data)
+	{
+		uchar b = uchar(c);
+		*out++ = QChar(b >= 0x80 && b < 0xA0 ? c1[b - 0x80] : ushort(b));
+	}
+	return result;
+}
+
+void QSmartCardDataPrivate::appendRecord(QSmartCardData::PersonalDataType type, const QByteArray &record)
+{
+	// Records are appended in PersonalDataType order
+	records += record.trimmed();
+	recordEnd[size_t(type)] = records.size();
+	raw |= 1U << type;
+	present |= 1U << type;
+	decoded &= ~(1U << type);
+}
+
+void QSmartCardDataPrivate::clearData()
+{
+	records.clear();
+	recordEnd.fill(0);
+	raw = present = decoded = 0;
+	text.fill(QString());
+	dates.fill(QDateTime());
+	authCert = QSslCertificate();
+	signCert = QSslCertificate();
+	loaded = certsLoaded = cached = false;
+}
+
+void QSmartCardDataPrivate::setData(QSmartCardData::PersonalDataType type, const QString &value)
+{
+	text[size_t(type)] = value;
+	present |= 1U << type;
+	decoded |= 1U << type;
+}
+
+void QSmartCardDataPrivate::setData(QSmartCardData::PersonalDataType type, const QDateTime &value)
+{
+	dates[size_t(dateIndex(type))] = value;
+	present |= 1U << type;
+	decoded |= 1U << type;
+}
+
+void QSmartCardDataPrivate::setCertificates(const SslCertificate &auth, const SslCertificate &sign)
+{
+	authCert = auth;
+	signCert = sign;
+	certsLoaded = true;
+	setData(QSmartCardData::Email, authCert.subjectAlternativeNames().values(QSsl::EmailEntry).value(0));
+	if(authCert.type() & SslCertificate::DigiIDType)
+	{
+		setData(QSmartCardData::SurName, authCert.toString("SN"));
+		setData(QSmartCardData::FirstName1, authCert.toString("GN"));
+		setData(QSmartCardData::FirstName2, QString());
+		setData(QSmartCardData::Id, authCert.subjectInfo("serialNumber"));
+		setData(QSmartCardData::BirthDate, QDateTime(IKValidator::birthDate(authCert.subjectInfo("serialNumber"))));
+		setData(QSmartCardData::IssueDate, authCert.effectiveDate());
+		setData(QSmartCardData::Expiry, authCert.expiryDate());
+	}
+}
+
+bool QSmartCardDataPrivate::samePersonalData(const QSmartCardDataPrivate &other) const
+{
+	if(records != other.records || recordEnd != other.recordEnd ||
+		raw != other.raw || present != other.present)
+		return false;
+	// Fields taken from certificate are not in records
+	quint32 assigned = present & ~raw;
+	if(!assigned)
+		return true;
+	QMutexLocker locker(&decodeLock);
+	QMutexLocker otherLocker(&other.decodeLock);
+	for(int i = QSmartCardData::SurName; i <= QSmartCardData::Email; ++i)
+	{
+		if(!(assigned & (1U << i)))
+			continue;
+		int date = dateIndex(QSmartCardData::PersonalDataType(i));
+		if(date < 0 ? text[size_t(i)] != other.text[size_t(i)] : dates[size_t(date)] != other.dates[size_t(date)])
+			return false;
+	}
+	return true;
+}
+
+QVariant QSmartCardDataPrivate::value(QSmartCardData::PersonalDataType type) const
+{
+	if(!(present & (1U << type)))
+		return QVariant();
+
+	QMutexLocker locker(&decodeLock);
+	if(quint32 pending = raw & ~decoded)
+	{
+		// Decode all pending records at once, most pages show several fields
+		QString all = fromCP1252(records);
+		for(int i = QSmartCardData::SurName; i <= QSmartCardData::Email; ++i)
+		{
+			if(!(pending & (1U << i)))
+				continue;
+			int begin = i == QSmartCardData::SurName ? 0 : recordEnd[size_t(i - 1)];
+			QString record = all.mid(begin, recordEnd[size_t(i)] - begin);
+			if(record == QChar(0))
+				record.clear();
+			int date = dateIndex(QSmartCardData::PersonalDataType(i));
+			if(date < 0)
+				text[size_t(i)] = record;
+			else
+				dates[size_t(date)] = QDateTime(QDate::fromString(record, "dd.MM.yyyy"));
+		}
+		decoded |= pending;
+	}
+
+	int date = dateIndex(type);
+	return date < 0 ? QVariant(text[size_t(type)]) : QVariant(dates[size_t(date)]);
+}
+
+
+const unsigned long QSmartCardPolicy::maximum;
+
+void QSmartCardPolicy::setActive(bool value)
+{
+	if(active.exchange(value) != value && value)
+		wake();
+}
+
+void QSmartCardPolicy::requestCounters()
+{
+	countersDue = true;
+	watcher->cancel();
+}
+
+unsigned long QSmartCardPolicy::poll(bool noReaders)
+{
+	emptyRounds = noReaders ? qMin(emptyRounds + 1, 4) : 0;
+	unsigned long msec = (active ? 5000UL : 30000UL) << qMax(emptyRounds - 1, 0);
+	return qMin(msec, maximum);
+}
+
+unsigned long QSmartCardPolicy::retry(unsigned long msec)
+{
+	msec <<= failures;
+	failures = qMin(failures + 1, 6);
+	if(!active)
+		msec *= 4;
+	return qMin(msec, maximum);
+}
+
+void QSmartCardPolicy::wake()
+{
+	failures = 0;
+	watcher->cancel();
+}
+
+
+
+QSmartCardWatcher::~QSmartCardWatcher()
+{
+	if(context)
+		SCardReleaseContext(context);
+}
+
+void QSmartCardWatcher::cancel()
+{
+	QMutexLocker locker(&lock);
+	pending = true;
+	// Waiter may be between pending check and SCardGetStatusChange, where SCardCancel has
+	// no effect. Repeat until the call returns, it does so at once when cancel lands
+	for(int i = 0; context && waiting && pending && i < 100; ++i)
+	{
+		SCardCancel(context);
+		returned.wait(&lock, 10);
+	}
+	wakeup.wakeAll();
+}
+
+bool QSmartCardWatcher::establish()
+{
+	if(context)
+		return true;
+	SCARDCONTEXT established = 0;
+	if(SCardEstablishContext(SCARD_SCOPE_USER, nullptr, nullptr, &established) != SCARD_S_SUCCESS)
+		return false;
+	{
+		QMutexLocker locker(&lock);
+		context = established;
+	}
+	SCARD_READERSTATE state = {};
+	state.szReader = "\\\\?PnP?\\Notification";
+	state.dwCurrentState = SCARD_STATE_UNAWARE;
+	LONG err = SCardGetStatusChange(context, 0, &state, 1);
+	pnpSupported = (err == SCARD_S_SUCCESS || err == SCARD_E_TIMEOUT) && !(state.dwEventState & SCARD_STATE_UNKNOWN);
+	pnp = state.dwEventState & ~SCARD_STATE_CHANGED;
+	states.clear();
+	qDebug() << "Reader hot-plug notification supported" << pnpSupported;
+	return true;
+}
+
+void QSmartCardWatcher::sleep(unsigned long msec)
+{
+	QMutexLocker locker(&lock);
+	if(!pending.exchange(false))
+		wakeup.wait(&lock, msec);
+	pending = false;
+}
+
+quint32 QSmartCardWatcher::state(const QString &reader) const
+{
+	return quint32(states.value(reader, SCARD_STATE_UNAWARE) & mask);
+}
+
+bool QSmartCardWatcher::wait(const QStringList &readers, unsigned long msec, unsigned long fallback)
+{
+	// Without hot-plug notifications reader list must be polled after fallback
+	if(!establish())
+	{
+		sleep(qMin(msec, fallback));
+		return true;
+	}
+
+	for(const QString &reader: states.keys())
+		if(!readers.contains(reader))
+			states.remove(reader);
+
+	QList<QByteArray> names;
+	for(const QString &reader: readers)
+		names << reader.toUtf8();
+	std::vector<SCARD_READERSTATE> list(size_t(names.size()));
+	for(int i = 0; i < names.size(); ++i)
+	{
+		list[size_t(i)].szReader = names[i].constData();
+		list[size_t(i)].dwCurrentState = states.value(readers[i], SCARD_STATE_UNAWARE);
+	}
+	if(pnpSupported)
+	{
+		SCARD_READERSTATE state = {};
+		state.szReader = "\\\\?PnP?\\Notification";
+		state.dwCurrentState = pnp;
+		list.push_back(state);
+	}
+	else
+		msec = qMin(msec, fallback);
+	if(list.empty())
+	{
+		sleep(msec);
+		return true;
+	}
+
+	QElapsedTimer timer;
+	timer.start();
+	Q_FOREVER
+	{
+		DWORD timeout = INFINITE;
+		if(msec != ULONG_MAX)
+			timeout = DWORD(qMax<qint64>(0, qint64(msec) - timer.elapsed()));
+		{
+			QMutexLocker locker(&lock);
+			if(pending.exchange(false))
+				return true;
+			waiting = true;
+		}
+		LONG err = SCardGetStatusChange(context, timeout, list.data(), DWORD(list.size()));
+		{
+			QMutexLocker locker(&lock);
+			waiting = false;
+			returned.wakeAll();
+		}
+		switch(err)
+		{
+		case SCARD_S_SUCCESS: break;
+		case SCARD_E_TIMEOUT: return false;
+		case SCARD_E_CANCELLED:
+			pending = false;
+			return true;
+		case SCARD_E_UNKNOWN_READER: return true; // Reader was removed after listing
+		default:
+			qDebug() << "SCardGetStatusChange failed" << QString::number(quint32(err), 16);
+			{
+				QMutexLocker locker(&lock);
+				SCardReleaseContext(context);
+				context = 0;
+			}
+			sleep(qMin(msec, fallback));
+			return true;
+		}
+
+		bool changed = false;
+		for(int i = 0; i < names.size(); ++i)
+		{
+			SCARD_READERSTATE &state = list[size_t(i)];
+			DWORD event = state.dwEventState & ~SCARD_STATE_CHANGED;
+			if((event ^ state.dwCurrentState) & mask)
+				changed = true;
+			state.dwCurrentState = event;
+			states[readers[i]] = event;
+		}
+		if(pnpSupported && list.back().dwEventState & SCARD_STATE_CHANGED)
+		{
+			changed = true;
+			pnp = list.back().dwEventState & ~SCARD_STATE_CHANGED;
+			list.back().dwCurrentState = pnp;
+		}
+		if(changed)
+			return true;
+	}
+}
+
+
+
+QSharedPointer<QPCSCReader> QSmartCardPrivate::connect(const QString &reader)
+{
+	// Reuse open card handle, transaction fails when card was reset or removed meanwhile
+	// Someone else may have selected other file between our transactions
+	QSharedPointer<ReaderQueue> q = queue(reader);
+	q->selected = SelectedFile();
+	if(!q->session || !q->session->beginTransaction())
+	{
+		qDebug() << "Connecting to reader" << reader;
+		q->session.reset(new QPCSCReader(reader, &QPCSC::instance()));
+		if(!q->session->connect() || !q->session->beginTransaction())
+		{
+			q->session.clear();
+			return QSharedPointer<QPCSCReader>();
+		}
+	}
+	q->held.start();
+	return q->session;
+}
+
+QSmartCard::ErrorType QSmartCardPrivate::handlePinResult(QPCSCReader *reader, const QString &card, QPCSCReader::Result response, bool forceUpdate)
+{
+	if(!response.resultOk() || forceUpdate)
+		refreshCounters(reader, card);
+	switch((quint8(response.SW[0]) << 8) + quint8(response.SW[1]))
+	{
+	case 0x9000: return QSmartCard::NoError;
+	case 0x63C0: return QSmartCard::BlockedError;//pin retry count 0
+	case 0x63C1: // Validate error, 1 tries left
+	case 0x63C2: // Validate error, 2 tries left
+	case 0x63C3: return QSmartCard::ValidateError;
+	case 0x6400: // Timeout (SCM)
+	case 0x6401: return QSmartCard::CancelError; // Cancel (OK, SCM)
+	case 0x6402: return QSmartCard::DifferentError;
+	case 0x6403: return QSmartCard::LenghtError;
+	case 0x6983: return QSmartCard::BlockedError;
+	case 0x6985: return QSmartCard::OldNewPinSameError;
+	case 0x6A80: return QSmartCard::OldNewPinSameError;
+	default: return QSmartCard::UnknownError;
+	}
+}
+
+QSmartCard::ErrorType QSmartCardPrivate::change(const QSmartCardData &t, QSmartCardData::PinType type, const QString &newpin, const QString &pin)
+{
+	lock(t.reader(), Interactive);
+	QSharedPointer<QPCSCReader> reader(connect(t.reader()));
+	if(!reader)
+	{
+		release(t.reader(), "change");
+		return QSmartCard::UnknownError;
+	}
+	Apdu cmd(CHANGE);
+	cmd[3] = type == QSmartCardData::PukType ? 0 : type;
+	cmd[4] = pin.size() + newpin.size();
+	QPCSCReader::Result result;
+	if(t.isPinpad())
+	{
+		// Runs on executor thread, waiting for PinPad does not block UI
+		result = reader->transferCTL(cmd.data(), false, language(), [](QSmartCardData::PinType type){
+			switch(type)
+			{
+			default:
+			case QSmartCardData::Pin1Type: return 4;
+			case QSmartCardData::Pin2Type: return 5;
+			case QSmartCardData::PukType: return 8;
+			}
+		}(type));
+	}
+	else
+		result = transfer(reader.data(), cmd << pin.toUtf8() << newpin.toUtf8());
+	QSmartCard::ErrorType err = handlePinResult(reader.data(), t.card(), result, true);
+	release(t.reader(), "change");
+	return err;
+}
+
+QSmartCard::ErrorType QSmartCardPrivate::unblock(const QSmartCardData &t, QSmartCardData::PinType type, const QString &pin, const QString &puk)
+{
+	lock(t.reader(), Interactive);
+	QSharedPointer<QPCSCReader> reader(connect(t.reader()));
+	if(!reader)
+	{
+		release(t.reader(), "unblock");
+		return QSmartCard::UnknownError;
+	}
+
+	Apdu cmd(VERIFY);
+	QPCSCReader::Result result;
+
+	if(!t.isPinpad())
+	{
+		//Verify PUK. Not for pinpad.
+		cmd[3] = 0;
+		cmd[4] = puk.size();
+		result = transfer(reader.data(), Apdu(cmd) << puk.toUtf8());
+		if(!result.resultOk())
+		{
+			QSmartCard::ErrorType err = handlePinResult(reader.data(), t.card(), result, false);
+			release(t.reader(), "unblock");
+			return err;
+		}
+	}
+
+	// Make sure pin is locked. ID card is designed so that only blocked PIN could be unblocked with PUK!
+	cmd[3] = type;
+	cmd[4] = pin.size() + 1;
+	for(int i = 0; i <= t.retryCount(type); ++i)
+	{
+		Apdu wrong(cmd);
+		for(int j = 0; j < pin.size(); ++j)
+			wrong << '0';
+		transfer(reader.data(), wrong << char('0' + i));
+	}
+
+	//Replace PIN with PUK
+	Apdu replace(REPLACE);
+	replace[3] = type;
+	replace[4] = puk.size() + pin.size();
+	if(t.isPinpad())
+	{
+		// Runs on executor thread, waiting for PinPad does not block UI
+		result = reader->transferCTL(replace.data(), false, language(), [](QSmartCardData::PinType type){
+			switch(type)
+			{
+			default:
+			case QSmartCardData::Pin1Type: return 4;
+			case QSmartCardData::Pin2Type: return 5;
+			case QSmartCardData::PukType: return 8;
+			}
+		}(type));
+	}
+	else
+		result = transfer(reader.data(), replace << puk.toUtf8() << pin.toUtf8());
+	QSmartCard::ErrorType err = handlePinResult(reader.data(), t.card(), result, true);
+	release(t.reader(), "unblock");
+	return err;
+}
+
+QSmartCard::ErrorType QSmartCardPrivate::login(const QSmartCardData &t, QSmartCardData::PinType type, const QByteArray &pin)
+{
+	lock(t.reader(), Interactive);
+	QSharedPointer<QPCSCReader> reader(connect(t.reader()));
+	if(!reader)
+	{
+		release(t.reader(), "login");
+		return QSmartCard::UnknownError;
+	}
+	Apdu cmd(VERIFY);
+	cmd[3] = type;
+	cmd[4] = pin.size();
+	QPCSCReader::Result result;
+	if(t.isPinpad())
+		result = reader->transferCTL(cmd.data(), true, language()); // Runs on executor thread
+	else
+		result = transfer(reader.data(), cmd << pin);
+	QSmartCard::ErrorType err = handlePinResult(reader.data(), t.card(), result, false);
+	release(t.reader(), "login");
+	if(result.resultOk())
+	{
+		QMutexLocker locker(&m);
+		this->reader = t.reader();
+	}
+	return err;
+}
+
+quint16 QSmartCardPrivate::language() const
+{
+	if(Settings().language() == "en") return 0x0409;
+	if(Settings().language() == "et") return 0x0425;
+	if(Settings().language() == "ru") return 0x0419;
+	return 0x0000;
+}
+
+QSmartCard::ErrorType QSmartCardPrivate::wait(const QFuture<QSmartCard::ErrorType> &future)
+{
+	// Keep UI responsive for blocking callers
+	QFutureWatcher<QSmartCard::ErrorType> watcher;
+	QEventLoop l;
+	QObject::connect(&watcher, &QFutureWatcherBase::finished, &l, &QEventLoop::quit);
+	watcher.setFuture(future);
+	if(!future.isFinished())
+		l.exec();
+	return future.result();
+}
+
+QFuture<QSmartCard::ErrorType> QSmartCardPrivate::run(const QString &reader, const std::function<QSmartCard::ErrorType ()> &task)
+{
+	QFuture<QSmartCard::ErrorType> future = Executor::instance().run<QSmartCard::ErrorType>(reader, task);
+	QMutexLocker locker(&m);
+	for(int i = tasks.size() - 1; i >= 0; --i)
+		if(tasks[i].isFinished())
+			tasks.removeAt(i);
+	tasks << future;
+	return future;
+}
+
+QSmartCardData QSmartCardPrivate::data() const
+{
+	return *std::atomic_load(&snapshot);
+}
+
+void QSmartCardPrivate::publish(const QSmartCardData &data)
+{
+	std::shared_ptr<const QSmartCardData> previous =
+		std::atomic_exchange(&snapshot, std::make_shared<const QSmartCardData>(data));
+	if(data.d->loaded && data.d->certsLoaded)
+	{
+		cache.insert(data.card() + "|" + data.reader(), new QSmartCardData(data));
+		if(diskCache && !data.d->cached && !(previous->d->certsLoaded && previous->card() == data.card()))
+			saveCache(data);
+	}
+	// Changes are collected and signaled once per event loop turn
+	int changes = diff(*previous, data);
+	// Flush that could not be queued would block all later change signals
+	if(changes && pendingChanges.fetch_or(changes) == 0 &&
+		!QMetaObject::invokeMethod(q, "flushChanges", Qt::QueuedConnection))
+		pendingChanges = 0;
+}
+
+QSmartCard::Changes QSmartCardPrivate::diff(const QSmartCardData &a, const QSmartCardData &b)
+{
+	QSmartCard::Changes changes;
+	if(a.d == b.d)
+		return changes;
+	if(a.readers() != b.readers())
+		changes |= QSmartCard::ReaderListChanged;
+	if(a.cards() != b.cards())
+		changes |= QSmartCard::CardListChanged;
+	if(a.card() != b.card() || a.reader() != b.reader() || a.version() != b.version() ||
+		a.isPinpad() != b.isPinpad() || a.isNull() != b.isNull())
+		changes |= QSmartCard::CardChanged;
+	if(!a.d->samePersonalData(*b.d))
+		changes |= QSmartCard::PersonalDataChanged;
+	if(a.d->retry != b.d->retry || a.d->usage != b.d->usage)
+		changes |= QSmartCard::CountersChanged;
+	if(a.d->certsLoaded != b.d->certsLoaded || a.authCert() != b.authCert() || a.signCert() != b.signCert())
+		changes |= QSmartCard::CertificatesChanged;
+	return changes;
+}
+
+bool QSmartCardPrivate::loadCertificates(Priority priority)
+{
+	QSmartCardData t = data();
+	if(t.d->certsLoaded)
+		return true;
+	const QString name = t.reader();
+	if(!t.d->loaded || !lock(name, priority))
+		return false;
+
+	QSharedPointer<QPCSCReader> reader(connect(name));
+	SslCertificate authCert, signCert;
+	bool ok = reader && readCertificates(reader.data(), t.card(), t.version(), authCert, signCert);
+	release(name, "read certificates");
+	if(!ok)
+	{
+		qDebug() << "Failed to read certificates";
+		return false;
+	}
+
+	// User may have selected other card meanwhile
+	QMutexLocker locker(&m);
+	QSmartCardData latest = data();
+	if(latest.card() != t.card() || !latest.d->loaded)
+		return false;
+	if(latest.d->certsLoaded)
+		return true;
+	latest.d->setCertificates(authCert, signCert);
+	publish(latest);
+	return true;
+}
+
+bool QSmartCardPrivate::lock(const QString &reader, Priority priority)
+{
+	QSharedPointer<ReaderQueue> q = queue(reader);
+	QMutexLocker locker(&q->m);
+	if(priority == Background)
+	{
+		if(terminate)
+			return false;
+		// Do not delay user, refresh when reader is released
+		if(q->busy || q->interactive > 0)
+		{
+			q->deferred = true;
+			return false;
+		}
+		q->busy = true;
+		return true;
+	}
+	++q->interactive;
+	while(q->busy)
+		q->released.wait(&q->m);
+	--q->interactive;
+	q->busy = true;
+	return true;
+}
+
+void QSmartCardPrivate::release(const QString &reader, const char *operation)
+{
+	// Other applications and pcscd are locked out of the card while transaction is open
+	QSharedPointer<ReaderQueue> q = queue(reader);
+	if(q->session && q->held.isValid())
+	{
+		q->session->endTransaction();
+		qDebug() << "Transaction for" << operation << "held" << reader << q->held.elapsed() << "ms";
+		q->held.invalidate();
+	}
+	unlock(reader);
+}
+
+void QSmartCardPrivate::uncache(const QString &card, const QString &reader)
+{
+	for(const QString &key: cache.keys())
+	{
+		QStringList parts = key.split('|');
+		if(parts.value(0) == card || parts.value(1) == reader)
+			cache.remove(key);
+	}
+}
+
+QString QSmartCardPrivate::cacheDir()
+{
+	return QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/cards";
+}
+
+QString QSmartCardPrivate::cacheFile(const QString &card, const QByteArray &key)
+{
+	// Do not reveal document number in file name, keyed hash cannot be brute-forced without key
+	return cacheDir() + "/" + QMessageAuthenticationCode::hash(card.toUtf8(), key, QCryptographicHash::Sha256).toHex();
+}
+
+QByteArray QSmartCardPrivate::cacheKey(bool create)
+{
+	// Random per user key, kept apart from cache files and readable only by owner
+	static QMutex lock;
+	static QByteArray key;
+	QMutexLocker locker(&lock);
+	if(!key.isEmpty())
+		return key;
+	QString path = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + "/cardcache.key";
+	QFile file(path);
+	if(file.open(QFile::ReadOnly) && file.size() == 32)
+		return key = file.readAll();
+	file.close();
+	if(!create)
+		return QByteArray();
+	QByteArray random(32, 0);
+	if(RAND_bytes((unsigned char*)random.data(), random.size()) != 1)
+		return QByteArray();
+	QDir().mkpath(QFileInfo(path).absolutePath());
+	if(!file.open(QFile::WriteOnly|QFile::Truncate))
+		return QByteArray();
+	file.setPermissions(QFile::ReadOwner|QFile::WriteOwner);
+	if(file.write(random) != random.size())
+		return QByteArray();
+	return key = random;
+}
+
+void QSmartCardPrivate::clearCache()
+{
+	QDir(cacheDir()).removeRecursively();
+	QFile::remove(QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + "/cardcache.key");
+}
+
+/*
+ * File: iv 12 | tag 16 | AES-256-GCM encrypted data, document number is authenticated with the data
+ * Certificates are checked against card before entry is trusted, see revalidate()
+ */
+QSmartCardData QSmartCardPrivate::loadCache(const QString &card, const QString &reader) const
+{
+	QSmartCardData result;
+	QByteArray key = cacheKey(false);
+	if(key.isEmpty())
+		return result;
+	QFile file(cacheFile(card, key));
+	if(!file.open(QFile::ReadOnly))
+		return result;
+	QByteArray data = file.readAll();
+	if(data.size() <= 28)
+		return result;
+	QByteArray iv = data.left(12), tag = data.mid(12, 16), aad = card.toUtf8();
+	data = data.mid(28);
+	QByteArray payload(data.size(), 0);
+	int len = 0;
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	bool ok = EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), nullptr, (const unsigned char*)key.constData(), (const unsigned char*)iv.constData()) == 1 &&
+		EVP_DecryptUpdate(ctx, nullptr, &len, (const unsigned char*)aad.constData(), aad.size()) == 1 &&
+		EVP_DecryptUpdate(ctx, (unsigned char*)payload.data(), &len, (const unsigned char*)data.constData(), data.size()) == 1 &&
+		EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, tag.size(), tag.data()) == 1 &&
+		EVP_DecryptFinal_ex(ctx, (unsigned char*)payload.data() + len, &len) == 1;
+	EVP_CIPHER_CTX_free(ctx);
+	if(!ok)
+	{
+		qDebug() << "Failed to decrypt cached card data";
+		return result;
+	}
+
+	QDataStream stream(payload);
+	QString storedCard, storedReader;
+	qint32 version = 0;
+	bool pinpad = false;
+	QByteArray records, authCert, signCert;
+	QList<qint32> recordEnd;
+	quint32 raw = 0, present = 0;
+	QList<quint8> retry;
+	QList<quint32> usage;
+	stream >> storedCard >> storedReader >> version >> pinpad >> records >> recordEnd >> raw >> present
+		>> retry >> usage >> authCert >> signCert;
+	if(stream.status() != QDataStream::Ok || storedCard != card || storedReader != reader ||
+		recordEnd.size() != int(result.d->recordEnd.size()) ||
+		retry.size() != int(result.d->retry.size()) || usage.size() != int(result.d->usage.size()))
+		return result;
+
+	QSharedDataPointer<QSmartCardDataPrivate> t(new QSmartCardDataPrivate);
+	t->card = card;
+	t->reader = reader;
+	t->version = QSmartCardData::CardVersion(version);
+	t->pinpad = pinpad;
+	t->records = records;
+	for(size_t i = 0; i < t->recordEnd.size(); ++i)
+		t->recordEnd[i] = recordEnd[int(i)];
+	t->raw = raw;
+	t->present = present;
+	for(size_t i = 0; i < t->retry.size(); ++i)
+	{
+		t->retry[i] = retry[int(i)];
+		t->usage[i] = usage[int(i)];
+	}
+	t->setCertificates(QSslCertificate(authCert, QSsl::Der), QSslCertificate(signCert, QSsl::Der));
+	t->loaded = true;
+	t->cached = true; // Certificates and counters are revalidated from card
+	result.d = t;
+	return result;
+}
+
+void QSmartCardPrivate::saveCache(const QSmartCardData &data) const
+{
+	QByteArray payload;
+	QDataStream stream(&payload, QIODevice::WriteOnly);
+	QList<qint32> recordEnd;
+	for(int end: data.d->recordEnd)
+		recordEnd << end;
+	QList<quint8> retry;
+	QList<quint32> usage;
+	for(size_t i = 0; i < data.d->retry.size(); ++i)
+	{
+		retry << data.d->retry[i];
+		usage << quint32(data.d->usage[i]);
+	}
+	stream << data.card() << data.reader() << qint32(data.version()) << data.isPinpad() << data.d->records << recordEnd
+		<< data.d->raw << data.d->present << retry << usage << data.authCert().toDer() << data.signCert().toDer();
+
+	QByteArray key = cacheKey(true);
+	if(key.isEmpty())
+		return;
+	QByteArray iv(12, 0), tag(16, 0), encrypted(payload.size(), 0), aad = data.card().toUtf8();
+	int len = 0;
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	bool ok = RAND_bytes((unsigned char*)iv.data(), iv.size()) == 1 &&
+		EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), nullptr, (const unsigned char*)key.constData(), (const unsigned char*)iv.constData()) == 1 &&
+		EVP_EncryptUpdate(ctx, nullptr, &len, (const unsigned char*)aad.constData(), aad.size()) == 1 &&
+		EVP_EncryptUpdate(ctx, (unsigned char*)encrypted.data(), &len, (const unsigned char*)payload.constData(), payload.size()) == 1 &&
+		EVP_EncryptFinal_ex(ctx, (unsigned char*)encrypted.data() + len, &len) == 1 &&
+		EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, tag.size(), tag.data()) == 1;
+	EVP_CIPHER_CTX_free(ctx);
+	if(!ok)
+		return;
+
+	QString path = cacheFile(data.card(), key);
+	QDir().mkpath(QFileInfo(path).absolutePath());
+	QFile file(path);
+	if(!file.open(QFile::WriteOnly|QFile::Truncate))
+		return;
+	file.setPermissions(QFile::ReadOwner|QFile::WriteOwner);
+	file.write(iv + tag + encrypted);
+}
+
+void QSmartCardPrivate::unlock(const QString &reader)
+{
+	QSharedPointer<ReaderQueue> q = queue(reader);
+	QMutexLocker locker(&q->m);
+	q->busy = false;
+	q->released.wakeOne();
+	if(q->interactive == 0 && q->deferred)
+	{
+		q->deferred = false;
+		watcher->cancel();
+	}
+}
+
+QSharedPointer<QSmartCardPrivate::ReaderQueue> QSmartCardPrivate::queue(const QString &reader)
+{
+	QMutexLocker locker(&m);
+	QSharedPointer<ReaderQueue> &q = queues[reader];
+	if(!q)
+		q.reset(new ReaderQueue);
+	return q;
+}
+
+bool QSmartCardPrivate::readData(QPCSCReader *reader, QSmartCardDataPrivate *t)
+{
+	t->reader = reader->name();
+	t->pinpad = reader->isPinPad();
+	t->version = cardVersion(reader->atr());
 
-QString QSmartCardData::reader() const { return d->reader; }
-QStringList QSmartCardData::readers() const { return d->readers; }
+	// Applet detected earlier for this card, check that it is still selectable.
+	// VER_INVALID is remembered when no applet was found and card default applet is used
+	const QString key = t->card + "|" + reader->atr();
+	m.lock();
+	QHash<QString,QSmartCardData::CardVersion>::const_iterator i = versions.constFind(key);
+	bool remembered = i != versions.constEnd();
+	QSmartCardData::CardVersion known = remembered ? i.value() : QSmartCardData::VER_INVALID;
+	m.unlock();
+	bool found = false;
+	switch(known)
+	{
+	case QSmartCardData::VER_3_0: found = select(reader, AID30).resultOk(); break;
+	case QSmartCardData::VER_3_4: found = select(reader, AID34).resultOk(); break;
+	case QSmartCardData::VER_USABLEUPDATER: found = select(reader, UPDATER_AID).resultOk(); break;
+	case QSmartCardData::VER_INVALID: found = remembered && select(reader, MASTER_FILE).resultOk(); break;
+	default: // Updater present, EstEID applet is usable
+		found = select(reader, AID35).resultOk() && select(reader, MASTER_FILE).resultOk();
+	}
+	if(found)
+	{
+		if(known != QSmartCardData::VER_INVALID)
+			t->version = known;
+	}
+	else if(t->version > QSmartCardData::VER_1_1)
+	{
+		known = QSmartCardData::VER_INVALID;
+		if(select(reader, AID30).resultOk())
+			known = QSmartCardData::VER_3_0;
+		else if(select(reader, AID34).resultOk())
+			known = QSmartCardData::VER_3_4;
+		else if(select(reader, UPDATER_AID).resultOk())
+		{
+			known = QSmartCardData::CardVersion(t->version|QSmartCardData::VER_HASUPDATER);
+			//Prefer EstEID applet when if it is usable
+			if(!select(reader, AID35).resultOk() ||
+				!select(reader, MASTER_FILE).resultOk())
+			{
+				select(reader, UPDATER_AID);
+				known = QSmartCardData::VER_USABLEUPDATER;
+			}
+		}
+		if(known != QSmartCardData::VER_INVALID)
+			t->version = known;
+		QMutexLocker locker(&m);
+		versions[key] = known;
+	}
 
-QVariant QSmartCardData::data(PersonalDataType type) const
-{ return d->data.value(type); }
-SslCertificate QSmartCardData::authCert() const { return d->authCert; }
-SslCertificate QSmartCardData::signCert() const { return d->signCert; }
-quint8 QSmartCardData::retryCount(PinType type) const { return d->retry.value(type); }
-ulong QSmartCardData::usageCount(PinType type) const { return d->usage.value(type); }
-QSmartCardData::CardVersion QSmartCardData::version() const { return d->version; }
+	bool tryAgain = true;
+	for(int attempt = 0; tryAgain && attempt < CardFile::readAttempts; ++attempt)
+	{
+		if(attempt > 0)
+			QThread::msleep(CardFile::readBackoff << (attempt - 1));
+		if(terminate)
+			return false;
+		QPCSCReader::Result failed;
+		tryAgain = !updateCounters(reader, t, &failed);
+		if(tryAgain && CardFile::cardRemoved(failed))
+		{
+			qDebug() << "Card removed, stop reading";
+			return false;
+		}
+	}
+	if(select(reader, PERSONALDATA).resultOk())
+	{
+		// Continue after records read in previous attempts, they are stored in order
+		Apdu cmd(READRECORD);
+		for(int data = QSmartCardData::SurName; data != QSmartCardData::Comment4 && !tryAgain; ++data)
+		{
+			if(t->raw & (1U << data))
+				continue;
+			cmd[2] = data + 1;
+			QPCSCReader::Result result;
+			for(int attempt = 0; !result.resultOk() && attempt < CardFile::readAttempts && !terminate; ++attempt)
+			{
+				if(attempt > 0)
+					QThread::msleep(CardFile::readBackoff << (attempt - 1));
+				result = transfer(reader, cmd);
+				if(CardFile::cardRemoved(result))
+				{
+					qDebug() << "Card removed, stop reading";
+					return false;
+				}
+			}
+			if(!result.resultOk())
+				tryAgain = true;
+			else
+				t->appendRecord(QSmartCardData::PersonalDataType(data), result.data);
+		}
+	}
+	t->loaded = !tryAgain;
+	return !tryAgain;
+}
 
-QString QSmartCardData::typeString(QSmartCardData::PinType type)
+bool QSmartCardPrivate::readCertificates(QPCSCReader *reader, const QString &card, QSmartCardData::CardVersion version,
+	SslCertificate &authCert, SslCertificate &signCert)
 {
-	switch(type)
+	// Own transaction, card may have been reset or other application may have selected other files
+	switch(version)
 	{
-	case Pin1Type: return "PIN1";
-	case Pin2Type: return "PIN2";
-	case PukType: return "PUK";
+	case QSmartCardData::VER_3_0: select(reader, AID30); break;
+	case QSmartCardData::VER_3_4: select(reader, AID34); break;
+	case QSmartCardData::VER_USABLEUPDATER: select(reader, UPDATER_AID); break;
+	default:
+		if(version != QSmartCardData::VER_INVALID && version & QSmartCardData::VER_HASUPDATER)
+			select(reader, AID35);
+		break;
 	}
-	return "";
-}
+	if(!select(reader, MASTER_FILE).resultOk() ||
+		!select(reader, ESTEIDDF).resultOk())
+		return false;
 
+	bool ok = true;
+	auto readCert = [&](const ApduLiteral &file) {
+		Apdu cmd(file);
+		if(reader->protocol() == QPCSCReader::T1)
+			cmd << char(0);
+		QPCSCReader::Result data = select(reader, cmd);
+		if(!data.resultOk())
+			return QSslCertificate();
+		QHash<quint8,QByteArray> fci = CardFile::parseFCI(data.data);
+		int size = fci.contains(0x85) ? quint8(fci[0x85][0]) << 8 | quint8(fci[0x85][1]) : 0x0600;
 
+		// Certificates change only on update, first chunk covers length, serial and issuer
+		const QString key = card + "|" + Apdu(file).data().toHex();
+		m.lock();
+		QSslCertificate known = knownCerts.value(key);
+		m.unlock();
+		QByteArray cert;
+		if(!known.isNull())
+		{
+			cert = CardFile::readBinary(reader, qMin(size, 0x0100), QByteArray(), &terminate);
+			if(!cert.isEmpty() && known.toDer().startsWith(cert))
+				return known;
+		}
+		cert = CardFile::readBinary(reader, size, cert, &terminate);
+		if(cert.isEmpty())
+		{
+			ok = false;
+			return QSslCertificate();
+		}
+		QSslCertificate result(cert, QSsl::Der);
+		QMutexLocker locker(&m);
+		knownCerts[key] = result;
+		return result;
+	};
+	authCert = readCert(AUTHCERT);
+	signCert = readCert(SIGNCERT);
+	return ok;
+}
 
-QSharedPointer<QPCSCReader> QSmartCardPrivate::connect(const QString &reader)
+void QSmartCardPrivate::refreshCounters(QPCSCReader *reader, const QString &card)
 {
-	qDebug() << "Connecting to reader" << reader;
-	QSharedPointer<QPCSCReader> r(new QPCSCReader(reader, &QPCSC::instance()));
-	if(r->connect() && r->beginTransaction())
-		return r;
-	return QSharedPointer<QPCSCReader>();
+	QSmartCardDataPrivate counters;
+	counters.card = card;
+	if(!updateCounters(reader, &counters))
+		return;
+	QMutexLocker locker(&m);
+	QSmartCardData t = data();
+	if(t.reader() != reader->name() || t.card() != counters.card)
+		return;
+	t.d->retry = counters.retry;
+	t.d->usage = counters.usage;
+	t.d->cached = false;
+	publish(t);
 }
 
-QSmartCard::ErrorType QSmartCardPrivate::handlePinResult(QPCSCReader *reader, QPCSCReader::Result response, bool forceUpdate)
+bool QSmartCardPrivate::revalidate(QPCSCReader *reader, const QSmartCardData &t)
 {
-	if(!response.resultOk() || forceUpdate)
-		updateCounters(reader, t.d);
-	switch((quint8(response.SW[0]) << 8) + quint8(response.SW[1]))
+	// Certificates may have been renewed outside this application, known ones are checked by first chunk
 	{
-	case 0x9000: return QSmartCard::NoError;
-	case 0x63C0: return QSmartCard::BlockedError;//pin retry count 0
-	case 0x63C1: // Validate error, 1 tries left
-	case 0x63C2: // Validate error, 2 tries left
-	case 0x63C3: return QSmartCard::ValidateError;
-	case 0x6400: // Timeout (SCM)
-	case 0x6401: return QSmartCard::CancelError; // Cancel (OK, SCM)
-	case 0x6402: return QSmartCard::DifferentError;
-	case 0x6403: return QSmartCard::LenghtError;
-	case 0x6983: return QSmartCard::BlockedError;
-	case 0x6985: return QSmartCard::OldNewPinSameError;
-	case 0x6A80: return QSmartCard::OldNewPinSameError;
-	default: return QSmartCard::UnknownError;
+		QMutexLocker locker(&m);
+		knownCerts[t.card() + "|" + Apdu(AUTHCERT).data().toHex()] = t.authCert();
+		knownCerts[t.card() + "|" + Apdu(SIGNCERT).data().toHex()] = t.signCert();
+	}
+	SslCertificate authCert, signCert;
+	QSmartCardDataPrivate counters;
+	counters.card = t.card();
+	if(!readCertificates(reader, t.card(), t.version(), authCert, signCert) || !updateCounters(reader, &counters))
+		return false;
+
+	QMutexLocker locker(&m);
+	QSmartCardData latest = data();
+	if(latest.reader() != reader->name() || latest.card() != t.card() || !latest.d->cached)
+		return true;
+	if(authCert != latest.authCert() || signCert != latest.signCert())
+	{
+		qDebug() << "Cached certificates differ from card, read card again";
+		uncache(t.card(), QString());
+		QByteArray key = cacheKey(false);
+		if(!key.isEmpty())
+			QFile::remove(cacheFile(t.card(), key));
+		latest.d->clearData();
+	}
+	else
+	{
+		latest.d->retry = counters.retry;
+		latest.d->usage = counters.usage;
+		latest.d->cached = false;
 	}
+	publish(latest);
+	return true;
 }
 
-quint16 QSmartCardPrivate::language() const
+bool QSmartCardPrivate::probe(QPCSC *pcsc, const QString &name, ReaderInfo &info) const
 {
-	if(Settings().language() == "en") return 0x0409;
-	if(Settings().language() == "et") return 0x0425;
-	if(Settings().language() == "ru") return 0x0419;
-	return 0x0000;
+	qDebug() << "Connecting to reader" << name;
+	QScopedPointer<QPCSCReader> reader(new QPCSCReader(name, pcsc));
+	if(!reader->isPresent())
+		return true;
+
+	QByteArray atr = reader->atr();
+	info.atr = atr;
+	if(cardVersion(atr) == QSmartCardData::VER_INVALID)
+	{
+		qDebug() << "Unknown ATR" << info.atr;
+		return true;
+	}
+
+	switch(reader->connectEx())
+	{
+	case 0x8010000CL: return true; //SCARD_E_NO_SMARTCARD
+	case 0:
+		if(reader->beginTransaction())
+			break;
+	default: return false;
+	}
+
+	QPCSCReader::Result result;
+	#define TRANSFERIFNOT(X) result = transfer(reader.data(), X); \
+		if(result.err) return false; \
+		if(!result.resultOk())
+
+	TRANSFERIFNOT(MASTER_FILE)
+	{	// Master file selection failed, test if it is updater applet
+		TRANSFERIFNOT(UPDATER_AID)
+			return true; // Updater applet not found
+		TRANSFERIFNOT(MASTER_FILE)
+		{	//Found updater applet but cannot select master file, select back 3.5
+			transfer(reader.data(), AID35);
+			return true;
+		}
+	}
+	TRANSFERIFNOT(ESTEIDDF)
+		return true;
+	TRANSFERIFNOT(PERSONALDATA)
+		return true;
+	Apdu cardid(READRECORD);
+	cardid[2] = 8;
+	TRANSFERIFNOT(cardid)
+		return true;
+	#undef TRANSFERIFNOT
+	info.card = codec->toUnicode(result.data);
+	return true;
 }
 
-QHash<quint8,QByteArray> QSmartCardPrivate::parseFCI(const QByteArray &data) const
+QPCSCReader::Result QSmartCardPrivate::select(QPCSCReader *reader, const Apdu &cmd)
 {
-	QHash<quint8,QByteArray> result;
-	for(QByteArray::const_iterator i = data.constBegin(); i != data.constEnd(); ++i)
+	if(!cmd.isValid())
+		return transfer(reader, cmd);
+	QByteArray apdu = cmd.data();
+	QSharedPointer<ReaderQueue> q = queue(reader->name());
+	SelectedFile &current = q->selected;
+	SelectedFile target;
+	QByteArray fid = apdu.mid(5);
+	switch(apdu.at(2))
 	{
-		quint8 tag(*i), size(*++i);
-		result[tag] = QByteArray(i + 1, size);
-		switch(tag)
+	case 0x00: // Master file
+		target.df = APDU("3F00");
+		break;
+	case 0x01: // Child DF of current DF
+		if(!current.df.isEmpty())
+			target.df = current.df + fid;
+		break;
+	case 0x02: // EF in current DF
+		if(!current.df.isEmpty())
 		{
-		case 0x6F:
-		case 0x62:
-		case 0x64:
-		case 0xA1: continue;
-		default: i += size; break;
+			target.df = current.df;
+			target.ef = fid;
 		}
+		break;
+	default: break; // Applet selection, path is unknown afterwards
 	}
+
+	// Already there, only selects without FCI response can be skipped
+	if(apdu.at(3) == 0x0C && !target.df.isEmpty() && current.df == target.df &&
+		(apdu.at(2) != 0x02 || current.ef == target.ef))
+	{
+		QPCSCReader::Result result;
+		result.SW = APDU("9000");
+		result.err = 0;
+		return result;
+	}
+
+	QPCSCReader::Result result = reader->transfer(apdu);
+	current = result.resultOk() ? target : SelectedFile();
 	return result;
 }
 
@@ -137,15 +1375,28 @@ int QSmartCardPrivate::rsa_sign(int type, const unsigned char *m, unsigned int m
 	if(type != NID_md5_sha1 ||
 		m_len != 36 ||
 		!d ||
-		!d->reader ||
-		!d->reader->transfer(d->SECENV1).resultOk() ||
-		!d->reader->transfer(APDU("002241B8 02 8300")).resultOk()) //Key reference, 8303801100
+		d->reader.isEmpty())
 		return 0;
 
-	QByteArray cmd = APDU("0088000000"); //calc signature
+	// PIN stays verified between transactions, security environment and current DF may not
+	d->lock(d->reader, Interactive);
+	QSharedPointer<QPCSCReader> reader = d->connect(d->reader);
+	if(!reader ||
+		!d->select(reader.data(), d->MASTER_FILE).resultOk() ||
+		!d->select(reader.data(), d->ESTEIDDF).resultOk() ||
+		!transfer(reader.data(), d->SECENV1).resultOk() ||
+		!transfer(reader.data(), APDU_LITERAL("002241B8 02 8300")).resultOk()) //Key reference, 8303801100
+	{
+		d->release(d->reader, "sign");
+		return 0;
+	}
+
+	Apdu cmd(APDU_LITERAL("0088000000")); //calc signature
 	cmd[4] = m_len;
-	cmd += QByteArray::fromRawData((const char*)m, m_len);
-	QPCSCReader::Result result = d->reader->transfer(cmd);
+	cmd << QByteArray::fromRawData((const char*)m, m_len);
+	QPCSCReader::Result result = transfer(reader.data(), cmd);
+	d->release(d->reader, "sign");
+	d->policy->requestCounters(); // Usage counter changed
 	if(!result.resultOk())
 		return 0;
 
@@ -154,52 +1405,74 @@ int QSmartCardPrivate::rsa_sign(int type, const unsigned char *m, unsigned int m
 	return 1;
 }
 
-bool QSmartCardPrivate::updateCounters(QPCSCReader *reader, QSmartCardDataPrivate *d)
+bool QSmartCardPrivate::updateCounters(QPCSCReader *reader, QSmartCardDataPrivate *d, QPCSCReader::Result *failed)
 {
-	if(!reader->transfer(MASTER_FILE).resultOk() ||
-		!reader->transfer(PINRETRY).resultOk())
+	// Failed response is passed to caller, e.g. to detect card removal
+	auto ok = [failed](const QPCSCReader::Result &result) {
+		if(!result.resultOk() && failed)
+			*failed = result;
+		return result.resultOk();
+	};
+	if(!ok(select(reader, MASTER_FILE)) ||
+		!ok(select(reader, PINRETRY)))
 		return false;
 
-	QByteArray cmd = READRECORD;
+	Apdu cmd(READRECORD);
 	for(int i = QSmartCardData::Pin1Type; i <= QSmartCardData::PukType; ++i)
 	{
 		cmd[2] = i;
-		QPCSCReader::Result data = reader->transfer(cmd);
-		if(!data.resultOk())
+		QPCSCReader::Result data = transfer(reader, cmd);
+		if(!ok(data))
 			return false;
-		d->retry[QSmartCardData::PinType(i)] = data.data[5];
+		d->retry[size_t(i)] = data.data[5];
 	}
 
-	if(!reader->transfer(ESTEIDDF).resultOk() ||
-		!reader->transfer(KEYPOINTER).resultOk())
+	if(!ok(select(reader, ESTEIDDF)))
 		return false;
 
-	cmd[2] = 1;
-	QPCSCReader::Result data = reader->transfer(cmd);
-	if(!data.resultOk())
-		return false;
+	// Key slots do not change for card, read only once
+	m.lock();
+	QPair<quint8,quint8> keys = keySlots.value(d->card);
+	m.unlock();
+	QPCSCReader::Result data;
+	if(d->card.isEmpty() || keys.first == 0)
+	{
+		if(!ok(select(reader, KEYPOINTER)))
+			return false;
+		cmd[2] = 1;
+		data = transfer(reader, cmd);
+		if(!ok(data))
+			return false;
 
-	/*
-	 * SIGN1 0100 1
-	 * SIGN2 0200 2
-	 * AUTH1 1100 3
-	 * AUTH2 1200 4
-	 */
-	quint8 signkey = data.data.at(0x13) == 0x01 && data.data.at(0x14) == 0x00 ? 1 : 2;
-	quint8 authkey = data.data.at(0x09) == 0x11 && data.data.at(0x0A) == 0x00 ? 3 : 4;
+		/*
+		 * SIGN1 0100 1
+		 * SIGN2 0200 2
+		 * AUTH1 1100 3
+		 * AUTH2 1200 4
+		 */
+		keys.first = data.data.at(0x13) == 0x01 && data.data.at(0x14) == 0x00 ? 1 : 2;
+		keys.second = data.data.at(0x09) == 0x11 && data.data.at(0x0A) == 0x00 ? 3 : 4;
+		if(!d->card.isEmpty())
+		{
+			QMutexLocker locker(&m);
+			keySlots[d->card] = keys;
+		}
+	}
+	quint8 signkey = keys.first;
+	quint8 authkey = keys.second;
 
-	if(!reader->transfer(KEYUSAGE).resultOk())
+	if(!ok(select(reader, KEYUSAGE)))
 		return false;
 
 	cmd[2] = authkey;
-	data = reader->transfer(cmd);
-	if(!data.resultOk())
+	data = transfer(reader, cmd);
+	if(!ok(data))
 		return false;
 	d->usage[QSmartCardData::Pin1Type] = 0xFFFFFF - ((quint8(data.data[12]) << 16) + (quint8(data.data[13]) << 8) + quint8(data.data[14]));
 
 	cmd[2] = signkey;
-	data = reader->transfer(cmd);
-	if(!data.resultOk())
+	data = transfer(reader, cmd);
+	if(!ok(data))
 		return false;
 	d->usage[QSmartCardData::Pin2Type] = 0xFFFFFF - ((quint8(data.data[12]) << 16) + (quint8(data.data[13]) << 8) + quint8(data.data[14]));
 	return true;
@@ -219,55 +1492,61 @@ QSmartCard::QSmartCard(QObject *parent)
 	RSA_meth_set1_name(d->method, "QSmartCard");
 	RSA_meth_set_sign(d->method, QSmartCardPrivate::rsa_sign);
 #endif
-	d->t.d->readers = QPCSC::instance().readers();
-	d->t.d->cards = QStringList() << "loading";
-	d->t.d->card = "loading";
+	d->q = this;
+	// Stored cards are removed when cache has been turned off
+	if(!d->diskCache)
+		QSmartCardPrivate::clearCache();
+	d->watcher = new QSmartCardWatcher;
+	d->policy = new QSmartCardPolicy(d->watcher);
+	QSmartCardData t;
+	t.d->readers = QPCSC::instance().readers();
+	t.d->cards = QStringList() << "loading";
+	t.d->card = "loading";
+	d->publish(t);
 }
 
 QSmartCard::~QSmartCard()
 {
+	QElapsedTimer timer;
+	timer.start();
 	d->terminate = true;
+	d->watcher->cancel();
 	wait();
+	// Only own operations use this object, other reader queue users are not waited for
+	d->m.lock();
+	QList<QFuture<ErrorType>> tasks = d->tasks;
+	d->tasks.clear();
+	d->m.unlock();
+	for(QFuture<ErrorType> &task: tasks)
+		task.waitForFinished();
+	qDebug() << "Card thread stopped in" << timer.elapsed() << "ms";
+	delete d->policy;
+	delete d->watcher;
 	delete d;
 }
 
 QSmartCard::ErrorType QSmartCard::change(QSmartCardData::PinType type, const QString &newpin, const QString &pin)
+{ return d->wait(changeAsync(type, newpin, pin)); }
+
+QFuture<QSmartCard::ErrorType> QSmartCard::changeAsync(QSmartCardData::PinType type, const QString &newpin, const QString &pin)
 {
-	QMutexLocker locker(&d->m);
-	QSharedPointer<QPCSCReader> reader(d->connect(d->t.reader()));
-	if(!reader)
-		return UnknownError;
-	QByteArray cmd = d->CHANGE;
-	cmd[3] = type == QSmartCardData::PukType ? 0 : type;
-	cmd[4] = pin.size() + newpin.size();
-	QPCSCReader::Result result;
-	if(d->t.isPinpad())
-	{
-		QEventLoop l;
-		std::thread([&]{
-			result = reader->transferCTL(cmd, false, d->language(), [](QSmartCardData::PinType type){
-				switch(type)
-				{
-				default:
-				case QSmartCardData::Pin1Type: return 4;
-				case QSmartCardData::Pin2Type: return 5;
-				case QSmartCardData::PukType: return 8;
-				}
-			}(type));
-			l.quit();
-		}).detach();
-		l.exec();
-	}
-	else
-		result = reader->transfer(cmd + pin.toUtf8() + newpin.toUtf8());
-	return d->handlePinResult(reader.data(), result, true);
+	QSmartCardData t = data();
+	return d->run(t.reader(), [=]{ return d->change(t, type, newpin, pin); });
 }
 
-QSmartCardData QSmartCard::data() const { return d->t; }
+QSmartCardData QSmartCard::data() const { return d->data(); }
+void QSmartCard::refresh()
+{
+	d->policy->wake();
+	d->policy->requestCounters();
+}
+void QSmartCard::setActive(bool active) { d->policy->setActive(active); }
 
 Qt::HANDLE QSmartCard::key()
 {
-	RSA *rsa = RSAPublicKey_dup((RSA*)d->t.authCert().publicKey().handle());
+	if(!loadCertificates())
+		return 0;
+	RSA *rsa = RSAPublicKey_dup((RSA*)data().authCert().publicKey().handle());
 	if (!rsa)
 		return 0;
 
@@ -285,357 +1564,419 @@ Qt::HANDLE QSmartCard::key()
 }
 
 QSmartCard::ErrorType QSmartCard::login(QSmartCardData::PinType type)
+{ return d->wait(loginAsync(type)); }
+
+QFuture<QSmartCard::ErrorType> QSmartCard::loginAsync(QSmartCardData::PinType type)
 {
+	auto finished = [](ErrorType err) {
+		QFutureInterface<ErrorType> result;
+		result.reportStarted();
+		result.reportResult(err);
+		result.reportFinished();
+		return result.future();
+	};
+
+	loadCertificates();
+	QSmartCardData t = data();
 	PinDialog::PinFlags flags = PinDialog::Pin1Type;
 	QSslCertificate cert;
 	switch(type)
 	{
-	case QSmartCardData::Pin1Type: flags = PinDialog::Pin1Type; cert = d->t.authCert(); break;
-	case QSmartCardData::Pin2Type: flags = PinDialog::Pin2Type; cert = d->t.signCert(); break;
-	default: return UnknownError;
+	case QSmartCardData::Pin1Type: flags = PinDialog::Pin1Type; cert = t.authCert(); break;
+	case QSmartCardData::Pin2Type: flags = PinDialog::Pin2Type; cert = t.signCert(); break;
+	default: return finished(UnknownError);
 	}
 
-	QScopedPointer<PinDialog> p;
+	// Dialog stays on GUI thread, card is accessed on reader queue
 	QByteArray pin;
-	if(!d->t.isPinpad())
+	if(!t.isPinpad())
 	{
-		p.reset(new PinDialog(flags, cert, 0, qApp->activeWindow()));
-		if(!p->exec())
-			return CancelError;
-		pin = p->text().toUtf8();
+		PinDialog p(flags, cert, 0, qApp->activeWindow());
+		if(!p.exec())
+			return finished(CancelError);
+		pin = p.text().toUtf8();
 	}
-	else
-		p.reset(new PinDialog(PinDialog::PinFlags(flags|PinDialog::PinpadFlag), cert, 0, qApp->activeWindow()));
-
-	d->m.lock();
-	d->reader = d->connect(d->t.reader());
-	if(!d->reader)
-		return UnknownError;
-	QByteArray cmd = d->VERIFY;
-	cmd[3] = type;
-	cmd[4] = pin.size();
-	QPCSCReader::Result result;
-	if(d->t.isPinpad())
+	QFuture<ErrorType> future = d->run(t.reader(), [=]{ return d->login(t, type, pin); });
+	if(t.isPinpad())
 	{
-		std::thread([&]{
-			Q_EMIT p->startTimer();
-			result = d->reader->transferCTL(cmd, true, d->language());
+		PinDialog *p = new PinDialog(PinDialog::PinFlags(flags|PinDialog::PinpadFlag), cert, 0, qApp->activeWindow());
+		QFutureWatcher<ErrorType> *watcher = new QFutureWatcher<ErrorType>(p);
+		QObject::connect(watcher, &QFutureWatcherBase::finished, p, [=]{
 			Q_EMIT p->finish(0);
-		}).detach();
-		p->exec();
-	}
-	else
-		result = d->reader->transfer(cmd + pin);
-	QSmartCard::ErrorType err = d->handlePinResult(d->reader.data(), result, false);
-	if(!result.resultOk())
-	{
-		d->updateCounters(d->reader.data(), d->t.d);
-		d->reader.clear();
-		d->m.unlock();
+			p->deleteLater();
+		});
+		p->open();
+		Q_EMIT p->startTimer();
+		watcher->setFuture(future);
 	}
-	return err;
+	return future;
+}
+
+bool QSmartCard::loadCertificates()
+{
+	if(d->data().d->certsLoaded)
+		return true;
+	return d->loadCertificates(QSmartCardPrivate::Interactive);
+}
+
+void QSmartCard::flushChanges()
+{
+	Changes changes = Changes(QFlag(d->pendingChanges.exchange(0)));
+	if(changes)
+		Q_EMIT dataChanged(changes);
 }
 
 void QSmartCard::logout()
 {
-	if(d->reader.isNull())
+	if(d->reader.isEmpty())
 		return;
-	d->updateCounters(d->reader.data(), d->t.d);
+	d->lock(d->reader, QSmartCardPrivate::Interactive);
+	QSharedPointer<QPCSCReader> reader(d->connect(d->reader));
+	if(reader)
+		d->refreshCounters(reader.data(), data().card());
+	d->release(d->reader, "logout");
 	d->reader.clear();
-	d->m.unlock();
+	d->watcher->cancel();
 }
 
-void QSmartCard::reload() { selectCard(d->t.card());  }
+void QSmartCard::reload()
+{
+	QSmartCardData t = data();
+	d->m.lock();
+	d->uncache(t.card(), QString());
+	// Detect applet again, card may have been updated
+	for(QHash<QString,QSmartCardData::CardVersion>::iterator i = d->versions.begin(); i != d->versions.end();)
+	{
+		if(i.key().startsWith(t.card() + "|"))
+			i = d->versions.erase(i);
+		else
+			++i;
+	}
+	d->keySlots.remove(t.card());
+	QByteArray key = d->cacheKey(false);
+	if(!key.isEmpty())
+		QFile::remove(d->cacheFile(t.card(), key));
+	d->m.unlock();
+	selectCard(t.card());
+}
 
 void QSmartCard::run()
 {
-	static const QHash<QByteArray,QSmartCardData::CardVersion> atrList{
-		{"3BFE9400FF80B1FA451F034573744549442076657220312E3043", QSmartCardData::VER_1_0}, /*ESTEID_V1_COLD_ATR*/
-		{"3B6E00FF4573744549442076657220312E30", QSmartCardData::VER_1_0}, /*ESTEID_V1_WARM_ATR*/
-		{"3BDE18FFC080B1FE451F034573744549442076657220312E302B", QSmartCardData::VER_1_0_2007}, /*ESTEID_V1_2007_COLD_ATR*/
-		{"3B5E11FF4573744549442076657220312E30", QSmartCardData::VER_1_0_2007}, /*ESTEID_V1_2007_WARM_ATR*/
-		{"3B6E00004573744549442076657220312E30", QSmartCardData::VER_1_1}, /*ESTEID_V1_1_COLD_ATR*/
-		{"3BFE1800008031FE454573744549442076657220312E30A8", QSmartCardData::VER_3_4}, /*ESTEID_V3_COLD_DEV1_ATR*/
-		{"3BFE1800008031FE45803180664090A4561B168301900086", QSmartCardData::VER_3_4}, /*ESTEID_V3_WARM_DEV1_ATR*/
-		{"3BFE1800008031FE45803180664090A4162A0083019000E1", QSmartCardData::VER_3_4}, /*ESTEID_V3_WARM_DEV2_ATR*/
-		{"3BFE1800008031FE45803180664090A4162A00830F9000EF", QSmartCardData::VER_3_4}, /*ESTEID_V3_WARM_DEV3_ATR*/
-		{"3BF9180000C00A31FE4553462D3443432D303181", QSmartCardData::VER_3_5}, /*ESTEID_V35_COLD_DEV1_ATR*/
-		{"3BF81300008131FE454A434F5076323431B7", QSmartCardData::VER_3_5}, /*ESTEID_V35_COLD_DEV2_ATR*/
-		{"3BFA1800008031FE45FE654944202F20504B4903", QSmartCardData::VER_3_5}, /*ESTEID_V35_COLD_DEV3_ATR*/
-		{"3BFE1800008031FE45803180664090A4162A00830F9000EF", QSmartCardData::VER_3_5}, /*ESTEID_V35_WARM_ATR*/
-		{"3BFE1800008031FE45803180664090A5102E03830F9000EF", QSmartCardData::VER_3_5}, /*UPDATER_TEST_CARDS*/
-	};
-
-	QByteArray cardid = d->READRECORD;
-	cardid[2] = 8;
 
+	QStringList readers;
+	// Card data read partially in previous round, resumed on next one
+	QSharedDataPointer<QSmartCardDataPrivate> partial;
 	while(!d->terminate)
 	{
-		if(d->m.tryLock())
-		{
-			// Get list of available cards
-			QMap<QString,QString> cards;
-			const QStringList readers = QPCSC::instance().readers();
-			if(![&] {
-				for(const QString &name: readers)
+		// Sleep until something happens, retry failed rounds after timeout
+		unsigned long timeout = 5000;
+
+		// Get list of available cards
+		QMap<QString,QString> cards;
+		readers = QPCSC::instance().readers();
+		d->watcher->wait(readers, 0); // Remember current state, changes after this wake up next round
+		// Failed reader is probed again next round, other readers are used meanwhile
+		bool probeFailed = ![&] {
+			for(const QString &name: d->readerInfo.keys())
+				if(!readers.contains(name))
+					d->readerInfo.remove(name);
+			{
+				QMutexLocker locker(&d->m);
+				for(const QString &name: d->queues.keys())
 				{
-					qDebug() << "Connecting to reader" << name;
-					QScopedPointer<QPCSCReader> reader(new QPCSCReader(name, &QPCSC::instance()));
-					if(!reader->isPresent())
-						continue;
+					QSharedPointer<QSmartCardPrivate::ReaderQueue> q = d->queues.value(name);
+					QMutexLocker queueLocker(&q->m);
+					if(!readers.contains(name) && !q->busy && q->interactive == 0)
+						d->queues.remove(name);
+				}
+			}
+			QStringList probe;
+			for(const QString &name: readers)
+			{
+				// Nothing has changed in this slot since last probe
+				quint32 state = d->watcher->state(name);
+				QHash<QString,QSmartCardPrivate::ReaderInfo>::const_iterator info = d->readerInfo.constFind(name);
+				if(state && info != d->readerInfo.constEnd() && info->state == state)
+				{
+					if(!info->card.isEmpty())
+						cards[info->card] = name;
+					continue;
+				}
+				probe << name;
+			}
 
-					if(!atrList.contains(reader->atr()))
+			// Probe changed readers concurrently, slow reader should not delay other slots
+			static const int maxProbeThreads = 16;
+			// Reader in use by user is skipped, probed again when released
+			enum { Failed, Done, Busy };
+			std::vector<QSmartCardPrivate::ReaderInfo> results(size_t(probe.size()));
+			std::vector<char> ok(size_t(probe.size()), Failed);
+			std::atomic<int> next{0};
+			auto worker = [&] {
+				QPCSC pcsc; // Own context, pcsc-lite serializes calls on one context
+				for(int i = next++; i < probe.size(); i = next++)
+				{
+					if(!d->lock(probe[i], QSmartCardPrivate::Background))
 					{
-						qDebug() << "Unknown ATR" << reader->atr();
+						ok[size_t(i)] = Busy;
 						continue;
 					}
-
-					switch(reader->connectEx())
-					{
-					case 0x8010000CL: continue; //SCARD_E_NO_SMARTCARD
-					case 0:
-						if(reader->beginTransaction())
-							break;
-					default: return false;
-					}
-
-					QPCSCReader::Result result;
-					#define TRANSFERIFNOT(X) result = reader->transfer(X); \
-						if(result.err) return false; \
-						if(!result.resultOk())
-
-					TRANSFERIFNOT(d->MASTER_FILE)
-					{	// Master file selection failed, test if it is updater applet
-						TRANSFERIFNOT(d->UPDATER_AID)
-							continue; // Updater applet not found
-						TRANSFERIFNOT(d->MASTER_FILE)
-						{	//Found updater applet but cannot select master file, select back 3.5
-							reader->transfer(d->AID35);
-							continue;
-						}
-					}
-					TRANSFERIFNOT(d->ESTEIDDF)
-						continue;
-					TRANSFERIFNOT(d->PERSONALDATA)
-						continue;
-					TRANSFERIFNOT(cardid)
-						continue;
-					QString nr = d->codec->toUnicode(result.data);
-					if(!nr.isEmpty())
-						cards[nr] = name;
+					d->queue(probe[i])->session.clear();
+					ok[size_t(i)] = d->probe(&pcsc, probe[i], results[size_t(i)]) ? Done : Failed;
+					d->unlock(probe[i]);
 				}
-				return true;
-			}())
+			};
+			std::vector<std::thread> workers;
+			for(int i = 1; i < qMin(probe.size(), maxProbeThreads); ++i)
+				workers.emplace_back(worker);
+			if(!probe.isEmpty())
+				worker();
+			for(std::thread &thread: workers)
+				thread.join();
+
+			bool result = true;
+			for(int i = 0; i < probe.size(); ++i)
 			{
-				qDebug() << "Failed to poll card, try again next round";
-				d->m.unlock();
-				sleep(5);
-				continue;
+				if(ok[size_t(i)] == Busy)
+				{
+					QHash<QString,QSmartCardPrivate::ReaderInfo>::const_iterator info = d->readerInfo.constFind(probe[i]);
+					if(info != d->readerInfo.constEnd() && !info->card.isEmpty())
+						cards[info->card] = probe[i];
+					continue;
+				}
+				// Slot has changed, cached data of this slot or moved card is outdated
+				{
+					QMutexLocker locker(&d->m);
+					d->uncache(results[size_t(i)].card, probe[i]);
+				}
+				if(ok[size_t(i)] == Failed)
+				{
+					// Keep card from last successful probe listed until slot is probed again
+					QString card = d->readerInfo.take(probe[i]).card;
+					if(!card.isEmpty())
+						cards[card] = probe[i];
+					result = false;
+					continue;
+				}
+				QSmartCardPrivate::ReaderInfo &info = d->readerInfo[probe[i]];
+				info = results[size_t(i)];
+				info.state = d->watcher->state(probe[i]);
+				if(!info.card.isEmpty())
+					cards[info.card] = probe[i];
 			}
+			return result;
+		}();
+		if(probeFailed)
+			qDebug() << "Failed to poll card, try again next round";
 
-			// cardlist has changed
-			QStringList order = cards.keys();
-			std::sort(order.begin(), order.end(), TokenData::cardsOrder);
-			bool update = d->t.cards() != order || d->t.readers() != readers;
+		// cardlist has changed
+		QStringList order = cards.keys();
+		std::sort(order.begin(), order.end(), TokenData::cardsOrder);
+		QMutexLocker locker(&d->m);
+		QSmartCardData current = d->data();
+		bool update = current.cards() != order || current.readers() != readers;
 
-			// check if selected card is still in slot
-			if(!d->t.card().isEmpty() && !order.contains(d->t.card()))
-			{
-				update = true;
-				d->t.d = new QSmartCardDataPrivate();
-			}
+		// check if selected card is still in slot
+		if(!current.card().isEmpty() && !order.contains(current.card()))
+		{
+			update = true;
+			current.d = new QSmartCardDataPrivate();
+		}
 
-			d->t.d->cards = order;
-			d->t.d->readers = readers;
+		current.d->cards = order;
+		current.d->readers = readers;
+		// Room for every inserted card, evicted entries would be prefetched again each round
+		d->cache.setMaxCost(qMax(8, readers.size() + 1));
 
-			// if none is selected select first from cardlist
-			if(d->t.card().isEmpty() && !d->t.cards().isEmpty())
+		// if none is selected select first from cardlist
+		if(current.card().isEmpty() && !current.cards().isEmpty())
+		{
+			current.d->card = current.cards().first();
+			current.d->clearData();
+			update = true;
+		}
+		if(update)
+			d->publish(current);
+
+		// read card data
+		timeout = ULONG_MAX;
+		locker.unlock();
+		const QString name = cards.value(current.card());
+		// Show data stored on previous use at once, counters are revalidated below
+		if(!name.isEmpty() && !current.d->loaded && d->diskCache)
+		{
+			QSmartCardData stored = d->loadCache(current.card(), name);
+			locker.relock();
+			QSmartCardData latest = d->data();
+			if(stored.d->loaded && latest.card() == stored.card() && !latest.d->loaded)
 			{
-				QSharedDataPointer<QSmartCardDataPrivate> t = d->t.d;
-				t->card = d->t.cards().first();
-				t->data.clear();
-				t->authCert = QSslCertificate();
-				t->signCert = QSslCertificate();
-				d->t.d = t;
-				update = true;
-				Q_EMIT dataChanged();
+				stored.d->cards = latest.cards();
+				stored.d->readers = latest.readers();
+				d->publish(stored);
+				current = stored;
 			}
+			locker.unlock();
+		}
 
-			// read card data
-			if(d->t.cards().contains(d->t.card()) && d->t.isNull())
+		// Stage 1: version, counters and personal data, shown as soon as read
+		if(!name.isEmpty() && !current.d->loaded && d->lock(name, QSmartCardPrivate::Background))
+		{
+			timeout = 5000;
+			QSharedPointer<QPCSCReader> reader(d->connect(name));
+			if(!reader.isNull())
 			{
-				update = true;
-				QSharedPointer<QPCSCReader> reader(d->connect(cards.value(d->t.card())));
-				if(!reader.isNull())
+				QSharedDataPointer<QSmartCardDataPrivate> t =
+					partial && partial->card == current.card() && partial->reader == name ? partial : current.d;
+				bool tryAgain = !d->readData(reader.data(), t.data());
+				d->release(name, "read card");
+
+				if(tryAgain)
+				{
+					qDebug() << "Failed to read card info, resume next round";
+					partial = t;
+					timeout = 1000;
+				}
+				else
 				{
-					QSharedDataPointer<QSmartCardDataPrivate> t = d->t.d;
-					t->reader = reader->name();
-					t->pinpad = reader->isPinPad();
-					t->version = atrList.value(reader->atr(), QSmartCardData::VER_INVALID);
-					if(t->version > QSmartCardData::VER_1_1)
+					partial.reset();
+					// User may have selected other card meanwhile
+					locker.relock();
+					QSmartCardData latest = d->data();
+					if(latest.card() == t->card)
 					{
-						if(reader->transfer(d->AID30).resultOk())
-							t->version = QSmartCardData::VER_3_0;
-						else if(reader->transfer(d->AID34).resultOk())
-							t->version = QSmartCardData::VER_3_4;
-						else if(reader->transfer(d->UPDATER_AID).resultOk())
-						{
-							t->version = QSmartCardData::CardVersion(t->version|QSmartCardData::VER_HASUPDATER);
-							//Prefer EstEID applet when if it is usable
-							if(!reader->transfer(d->AID35).resultOk() ||
-								!reader->transfer(d->MASTER_FILE).resultOk())
-							{
-								reader->transfer(d->UPDATER_AID);
-								t->version = QSmartCardData::VER_USABLEUPDATER;
-							}
-						}
+						t->cards = latest.cards();
+						t->readers = latest.readers();
+						latest.d = t;
+						d->publish(latest);
 					}
+					locker.unlock();
+					timeout = ULONG_MAX;
+				}
+			}
+			else
+				d->release(name, "read card");
+		}
 
-					bool tryAgain = !d->updateCounters(reader.data(), t);
-					if(reader->transfer(d->PERSONALDATA).resultOk())
-					{
-						QByteArray cmd = d->READRECORD;
-						for(int data = QSmartCardData::SurName; data != QSmartCardData::Comment4; ++data)
-						{
-							cmd[2] = data + 1;
-							QPCSCReader::Result result = reader->transfer(cmd);
-							if(!result.resultOk())
-							{
-								tryAgain = true;
-								break;
-							}
-							QString record = d->codec->toUnicode(result.data.trimmed());
-							if(record == QChar(0))
-								record.clear();
-							switch(data)
-							{
-							case QSmartCardData::BirthDate:
-							case QSmartCardData::Expiry:
-							case QSmartCardData::IssueDate:
-								t->data[QSmartCardData::PersonalDataType(data)] = QDate::fromString(record, "dd.MM.yyyy");
-								break;
-							default:
-								t->data[QSmartCardData::PersonalDataType(data)] = record;
-								break;
-							}
-						}
-					}
+		// Stage 2: certificates, unless already loaded on demand
+		current = d->data();
+		if(!name.isEmpty() && current.card() == cards.key(name) && current.d->loaded && !current.d->certsLoaded)
+		{
+			timeout = 5000;
+			if(d->loadCertificates(QSmartCardPrivate::Background))
+				timeout = ULONG_MAX;
+		}
 
-					auto readCert = [&](const QByteArray &file) {
-						QPCSCReader::Result data = reader->transfer(file + APDU(reader->protocol() == QPCSCReader::T1 ? "00" : ""));
-						if(!data.resultOk())
-							return QSslCertificate();
-						QHash<quint8,QByteArray> fci = d->parseFCI(data.data);
-						int size = fci.contains(0x85) ? fci[0x85][0] << 8 | fci[0x85][1] : 0x0600;
-						QByteArray cert;
-						while(cert.size() < size)
-						{
-							QByteArray cmd = d->READBINARY;
-							cmd[2] = cert.size() >> 8;
-							cmd[3] = cert.size();
-							data = reader->transfer(cmd);
-							if(!data.resultOk())
-							{
-								tryAgain = true;
-								return QSslCertificate();
-							}
-							cert += data.data;
-						}
-						return QSslCertificate(cert, QSsl::Der);
-					};
-					t->authCert = readCert(d->AUTHCERT);
-					t->signCert = readCert(d->SIGNCERT);
-
-					t->data[QSmartCardData::Email] = t->authCert.subjectAlternativeNames().values(QSsl::EmailEntry).value(0);
-					if(t->authCert.type() & SslCertificate::DigiIDType)
-					{
-						t->data[QSmartCardData::SurName] = t->authCert.toString("SN");
-						t->data[QSmartCardData::FirstName1] = t->authCert.toString("GN");
-						t->data[QSmartCardData::FirstName2] = QString();
-						t->data[QSmartCardData::Id] = t->authCert.subjectInfo("serialNumber");
-						t->data[QSmartCardData::BirthDate] = IKValidator::birthDate(t->authCert.subjectInfo("serialNumber"));
-						t->data[QSmartCardData::IssueDate] = t->authCert.effectiveDate();
-						t->data[QSmartCardData::Expiry] = t->authCert.expiryDate();
-					}
-					if(tryAgain)
-					{
-						qDebug() << "Failed to read card info, try again next round";
-						update = false;
-					}
-					else
-						d->t.d = t;
-				}
+		// Data restored from cache, certificates and counters may have been changed by other applications
+		current = d->data();
+		if(!name.isEmpty() && current.d->cached && d->lock(name, QSmartCardPrivate::Background))
+		{
+			QSharedPointer<QPCSCReader> reader(d->connect(name));
+			if(reader)
+				d->revalidate(reader.data(), current);
+			d->release(name, "revalidate");
+			current = d->data();
+			if(current.d->cached)
+				timeout = 5000;
+			else if(!current.d->loaded)
+				d->watcher->cancel(); // Stored entry was outdated, read card at once
+		}
+
+		// Counters changed by operation outside PIN dialogs
+		if(!name.isEmpty() && d->policy->takeCounters())
+		{
+			if(d->lock(name, QSmartCardPrivate::Background))
+			{
+				QSharedPointer<QPCSCReader> reader(d->connect(name));
+				if(reader)
+					d->refreshCounters(reader.data(), cards.key(name));
+				d->release(name, "refresh counters");
 			}
+			else
+				d->policy->deferCounters();
+		}
 
-			// update data if something has changed
-			if(update)
-				Q_EMIT dataChanged();
-			d->m.unlock();
+		// Prefetch other inserted cards, switching to them shows cached data.
+		// Card selected by user or other wake up is handled first
+		for(QMap<QString,QString>::const_iterator i = cards.constBegin(); i != cards.constEnd() &&
+			d->policy->isActive() && !d->terminate && !d->watcher->isPending(); ++i)
+		{
+			{
+				QMutexLocker cacheLocker(&d->m);
+				if(i.key() == d->data().card() || d->cache.contains(i.key() + "|" + i.value()))
+					continue;
+			}
+			if(d->diskCache)
+			{
+				QSmartCardData stored = d->loadCache(i.key(), i.value());
+				if(stored.d->loaded)
+				{
+					QMutexLocker cacheLocker(&d->m);
+					d->cache.insert(i.key() + "|" + i.value(), new QSmartCardData(stored));
+					continue;
+				}
+			}
+			if(!d->lock(i.value(), QSmartCardPrivate::Background))
+				continue;
+			QSharedDataPointer<QSmartCardDataPrivate> t(new QSmartCardDataPrivate);
+			t->card = i.key();
+			QSharedPointer<QPCSCReader> reader(d->connect(i.value()));
+			SslCertificate authCert, signCert;
+			bool ok = reader && d->readData(reader.data(), t.data()) &&
+				d->readCertificates(reader.data(), i.key(), t->version, authCert, signCert);
+			d->release(i.value(), "prefetch");
+			if(!ok)
+				continue;
+			t->setCertificates(authCert, signCert);
+			QSmartCardData prefetched;
+			prefetched.d = t;
+			QMutexLocker cacheLocker(&d->m);
+			d->cache.insert(i.key() + "|" + i.value(), new QSmartCardData(prefetched));
+			if(d->diskCache)
+				d->saveCache(prefetched);
 		}
-		sleep(5);
+
+		if(probeFailed && timeout == ULONG_MAX)
+			timeout = 5000;
+		if(timeout == ULONG_MAX)
+			d->policy->succeeded();
+		else
+			timeout = d->policy->retry(timeout);
+		d->watcher->wait(readers, timeout, d->policy->poll(readers.isEmpty()));
 	}
 }
 
 void QSmartCard::selectCard(const QString &card)
 {
 	QMutexLocker locker(&d->m);
-	QSharedDataPointer<QSmartCardDataPrivate> t = d->t.d;
-	t->card = card;
-	t->data.clear();
-	t->authCert = QSslCertificate();
-	t->signCert = QSslCertificate();
-	d->t.d = t;
-	Q_EMIT dataChanged();
-}
-
-QSmartCard::ErrorType QSmartCard::unblock(QSmartCardData::PinType type, const QString &pin, const QString &puk)
-{
-	QMutexLocker locker(&d->m);
-	QSharedPointer<QPCSCReader> reader(d->connect(d->t.reader()));
-	if(!reader)
-		return UnknownError;
-
-	QByteArray cmd = d->VERIFY;
-	QPCSCReader::Result result;
-
-	if(!d->t.isPinpad())
+	QSmartCardData t = d->data();
+	QSmartCardData *cached = nullptr;
+	for(const QString &key: d->cache.keys())
+		if(key.section('|', 0, 0) == card)
+			cached = d->cache.object(key);
+	if(cached)
 	{
-		//Verify PUK. Not for pinpad.
-		cmd[3] = 0;
-		cmd[4] = puk.size();
-		result = reader->transfer(cmd + puk.toUtf8());
-		if(!result.resultOk())
-			return d->handlePinResult(reader.data(), result, false);
+		// Show cached data at once, poller revalidates counters
+		QStringList cards = t.cards(), readers = t.readers();
+		t = *cached;
+		t.d->cards = cards;
+		t.d->readers = readers;
+		t.d->cached = true;
 	}
-
-	// Make sure pin is locked. ID card is designed so that only blocked PIN could be unblocked with PUK!
-	cmd[3] = type;
-	cmd[4] = pin.size() + 1;
-	for(int i = 0; i <= d->t.retryCount(type); ++i)
-		reader->transfer(cmd + QByteArray(pin.size(), '0') + QByteArray::number(i));
-
-	//Replace PIN with PUK
-	cmd = d->REPLACE;
-	cmd[3] = type;
-	cmd[4] = puk.size() + pin.size();
-	if(d->t.isPinpad())
+	else
 	{
-		QEventLoop l;
-		std::thread([&]{
-			result = reader->transferCTL(cmd, false, d->language(), [](QSmartCardData::PinType type){
-				switch(type)
-				{
-				default:
-				case QSmartCardData::Pin1Type: return 4;
-				case QSmartCardData::Pin2Type: return 5;
-				case QSmartCardData::PukType: return 8;
-				}
-			}(type));
-			l.quit();
-		}).detach();
-		l.exec();
+		t.d->card = card;
+		t.d->clearData();
 	}
-	else
-		result = reader->transfer(cmd + puk.toUtf8() + pin.toUtf8());
-	return d->handlePinResult(reader.data(), result, true);
+	d->publish(t);
+	locker.unlock();
+	d->watcher->cancel();
+}
+
+QSmartCard::ErrorType QSmartCard::unblock(QSmartCardData::PinType type, const QString &pin, const QString &puk)
+{ return d->wait(unblockAsync(type, pin, puk)); }
+
+QFuture<QSmartCard::ErrorType> QSmartCard::unblockAsync(QSmartCardData::PinType type, const QString &pin, const QString &puk)
+{
+	QSmartCardData t = data();
+	return d->run(t.reader(), [=]{ return d->unblock(t, type, pin, puk); });
 }
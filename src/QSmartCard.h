@@ -19,6 +19,7 @@
 
 #pragma once
 
+#include <QFuture>
 #include <QThread>
 
 #include <QSharedDataPointer>
@@ -119,22 +120,40 @@ public:
 		ValidateError,
 		OldNewPinSameError
 	};
+	enum Change
+	{
+		NoChange = 0,
+		ReaderListChanged = 1 << 0,
+		CardListChanged = 1 << 1,
+		CardChanged = 1 << 2,
+		PersonalDataChanged = 1 << 3,
+		CountersChanged = 1 << 4,
+		CertificatesChanged = 1 << 5
+	};
+	Q_DECLARE_FLAGS(Changes, Change)
 
 	explicit QSmartCard( QObject *parent = 0 );
 	~QSmartCard();
 
 	ErrorType change( QSmartCardData::PinType type, const QString &newpin, const QString &pin );
+	QFuture<ErrorType> changeAsync( QSmartCardData::PinType type, const QString &newpin, const QString &pin );
 	QSmartCardData data() const;
 	Qt::HANDLE key();
+	bool loadCertificates();
 	ErrorType login( QSmartCardData::PinType type );
+	QFuture<ErrorType> loginAsync( QSmartCardData::PinType type );
 	void logout();
+	void refresh();
 	void reload();
+	void setActive( bool active );
 	ErrorType unblock( QSmartCardData::PinType type, const QString &pin, const QString &puk );
+	QFuture<ErrorType> unblockAsync( QSmartCardData::PinType type, const QString &pin, const QString &puk );
 
 signals:
-	void dataChanged();
+	void dataChanged( QSmartCard::Changes changes );
 
 private Q_SLOTS:
+	void flushChanges();
 	void selectCard( const QString &card );
 
 private:
@@ -144,3 +163,5 @@ private:
 
 	friend class MainWindow;
 };
+
+Q_DECLARE_OPERATORS_FOR_FLAGS(QSmartCard::Changes)
@@ -19,33 +19,131 @@
 
 #include "QSmartCard.h"
 
+#include "Apdu.h"
+
 #include <common/QPCSC.h>
+#include <common/Settings.h>
 #include <common/SslCertificate.h>
 
+#include <QtCore/QCache>
+#include <QtCore/QDateTime>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFuture>
 #include <QtCore/QMutex>
 #include <QtCore/QStringList>
 #include <QtCore/QTextCodec>
 #include <QtCore/QVariant>
+#include <QtCore/QWaitCondition>
 
 #include <openssl/rsa.h>
 
+#include <array>
+#include <cstring>
+#include <atomic>
+#include <functional>
+#include <memory>
+
 #define APDU QByteArray::fromHex
 
+class QSmartCardPolicy;
+class QSmartCardWatcher;
 class QSmartCardPrivate
 {
 public:
+	// Interactive operations wait for the reader, background refresh skips busy reader
+	enum Priority
+	{
+		Background,
+		Interactive
+	};
+	struct ReaderQueue;
+
+	QSmartCard::ErrorType change(const QSmartCardData &t, QSmartCardData::PinType type, const QString &newpin, const QString &pin);
 	QSharedPointer<QPCSCReader> connect(const QString &reader);
-	QSmartCard::ErrorType handlePinResult(QPCSCReader *reader, QPCSCReader::Result response, bool forceUpdate);
+	QSmartCard::ErrorType handlePinResult(QPCSCReader *reader, const QString &card, QPCSCReader::Result response, bool forceUpdate);
+	QSmartCard::ErrorType login(const QSmartCardData &t, QSmartCardData::PinType type, const QByteArray &pin);
+	QSmartCard::ErrorType unblock(const QSmartCardData &t, QSmartCardData::PinType type, const QString &pin, const QString &puk);
+	static QSmartCard::ErrorType wait(const QFuture<QSmartCard::ErrorType> &future);
 	quint16 language() const;
-	QHash<quint8,QByteArray> parseFCI(const QByteArray &data) const;
-	bool updateCounters(QPCSCReader *reader, QSmartCardDataPrivate *d);
+	QSmartCardData data() const;
+	static QSmartCard::Changes diff(const QSmartCardData &a, const QSmartCardData &b);
+	void publish(const QSmartCardData &data);
+	bool loadCertificates(Priority priority);
+	bool lock(const QString &reader, Priority priority);
+	void release(const QString &reader, const char *operation);
+	void uncache(const QString &card, const QString &reader);
+	void unlock(const QString &reader);
+	QSharedPointer<ReaderQueue> queue(const QString &reader);
+	void refreshCounters(QPCSCReader *reader, const QString &card);
+	static QString cacheDir();
+	static QString cacheFile(const QString &card, const QByteArray &key);
+	static QByteArray cacheKey(bool create);
+	static void clearCache();
+	QSmartCardData loadCache(const QString &card, const QString &reader) const;
+	void saveCache(const QSmartCardData &data) const;
+	struct ReaderInfo;
+	bool probe(QPCSC *pcsc, const QString &name, ReaderInfo &info) const;
+	bool readCertificates(QPCSCReader *reader, const QString &card, QSmartCardData::CardVersion version,
+		SslCertificate &authCert, SslCertificate &signCert);
+	bool readData(QPCSCReader *reader, QSmartCardDataPrivate *t);
+	bool revalidate(QPCSCReader *reader, const QSmartCardData &t);
+	QFuture<QSmartCard::ErrorType> run(const QString &reader, const std::function<QSmartCard::ErrorType ()> &task);
+	QPCSCReader::Result select(QPCSCReader *reader, const Apdu &apdu);
+	static QPCSCReader::Result transfer(QPCSCReader *reader, const Apdu &apdu) { return CardFile::transfer(reader, apdu); }
+	bool updateCounters(QPCSCReader *reader, QSmartCardDataPrivate *d, QPCSCReader::Result *failed = nullptr);
 
 	static int rsa_sign(int type, const unsigned char *m, unsigned int m_len,
 		unsigned char *sigret, unsigned int *siglen, const RSA *rsa);
 
-	QSharedPointer<QPCSCReader> reader;
-	QMutex			m;
-	QSmartCardData	t;
+	// Last probe result, valid while PC/SC reader state stays the same.
+	// Empty card marks an empty slot or unsupported card
+	struct ReaderInfo
+	{
+		quint32 state = 0;
+		QByteArray atr;
+		QString card;
+	};
+
+	// Selected DF path and EF, known only inside our own transaction
+	struct SelectedFile
+	{
+		QByteArray df, ef;
+	};
+
+	// Per reader access, fields are owned by the thread holding the reader
+	struct ReaderQueue
+	{
+		QMutex m;
+		QWaitCondition released;
+		bool busy = false, deferred = false;
+		int interactive = 0; // Interactive operations waiting for the reader
+		QSharedPointer<QPCSCReader> session; // Card handle kept open between operations
+		SelectedFile selected;
+		QElapsedTimer held; // Running while session has transaction open
+	};
+
+	QString			reader; // Logged in reader, transaction is opened per operation
+	QHash<QString,QSharedPointer<ReaderQueue>> queues;
+	QHash<QString,ReaderInfo> readerInfo;
+	QMutex			m; // Serializes snapshot writers and guards queues, never held during card I/O
+	// Readers load and copy current snapshot without locking, published data is never modified
+	std::shared_ptr<const QSmartCardData> snapshot = std::make_shared<const QSmartCardData>();
+	std::atomic<int> pendingChanges{0}; // QSmartCard::Changes not yet signaled
+	QSmartCard		*q = nullptr;
+	// Fully read cards by "card|reader" for instant switching, sized by reader count, guarded by m
+	QCache<QString,QSmartCardData> cache{8};
+	// Last certificates read per card and file, validated by first chunk, guarded by m
+	QHash<QString,QSslCertificate> knownCerts;
+	// Detected applet version per card and ATR, VER_INVALID when card default applet is used, guarded by m
+	QHash<QString,QSmartCardData::CardVersion> versions;
+	// Sign and auth key record numbers per card, guarded by m
+	QHash<QString,QPair<quint8,quint8>> keySlots;
+	// Operations submitted to reader queues, waited for on destruction, guarded by m
+	QList<QFuture<QSmartCard::ErrorType>> tasks;
+	// Opt-in encrypted copy of fully read cards on disk, shown before card is read
+	bool			diskCache = Settings().value("Utility/cardCache", false).toBool();
+	QSmartCardWatcher *watcher = nullptr;
+	QSmartCardPolicy *policy = nullptr;
 	volatile bool	terminate = false;
 #if OPENSSL_VERSION_NUMBER < 0x10010000L
 	RSA_METHOD		method = *RSA_get_default_method();
@@ -54,36 +152,61 @@ public:
 #endif
 	QTextCodec		*codec = QTextCodec::codecForName("Windows-1252");
 
-	const QByteArray AID30 = APDU("00A40400 10 D2330000010000010000000000000000");
-	const QByteArray AID34 = APDU("00A40400 0E F04573744549442076657220312E");
-	const QByteArray AID35 = APDU("00A40400 0F D23300000045737445494420763335");
-	const QByteArray UPDATER_AID =	APDU("00A40400 0A D2330000005550443101");
-	const QByteArray MASTER_FILE =	APDU("00A4000C");// 00"); // Compatibilty for some cards
-	const QByteArray ESTEIDDF =		APDU("00A4010C 02 EEEE");
-	const QByteArray PERSONALDATA =	APDU("00A4020C 02 5044");
-	const QByteArray AUTHCERT =		APDU("00A40200 02 AACE");
-	const QByteArray SIGNCERT =		APDU("00A40200 02 DDCE");
-	const QByteArray KEYPOINTER =	APDU("00A4020C 02 0033");
-	const QByteArray KEYUSAGE =		APDU("00A4020C 02 0013");
-	const QByteArray PINRETRY =		APDU("00A4020C 02 0016");
-	const QByteArray READBINARY =	APDU("00B00000 00");
-	const QByteArray READRECORD =	APDU("00B20004 00");
-	const QByteArray SECENV1 =		APDU("0022F301");// 00"); // Compatibilty for some cards
-	const QByteArray SECENV3 =		APDU("0022F303 00");
-	const QByteArray CHANGE =		APDU("00240000 00");
-	const QByteArray REPLACE =		APDU("002C0000 00");
-	const QByteArray VERIFY =		APDU("00200000 00");
+	const ApduLiteral AID30 = APDU_LITERAL("00A40400 10 D2330000010000010000000000000000");
+	const ApduLiteral AID34 = APDU_LITERAL("00A40400 0E F04573744549442076657220312E");
+	const ApduLiteral AID35 = APDU_LITERAL("00A40400 0F D23300000045737445494420763335");
+	const ApduLiteral UPDATER_AID =	APDU_LITERAL("00A40400 0A D2330000005550443101");
+	const ApduLiteral MASTER_FILE =	APDU_LITERAL("00A4000C");// 00"; // Compatibilty for some cards
+	const ApduLiteral ESTEIDDF =		APDU_LITERAL("00A4010C 02 EEEE");
+	const ApduLiteral PERSONALDATA =	APDU_LITERAL("00A4020C 02 5044");
+	const ApduLiteral AUTHCERT =		APDU_LITERAL("00A40200 02 AACE");
+	const ApduLiteral SIGNCERT =		APDU_LITERAL("00A40200 02 DDCE");
+	const ApduLiteral KEYPOINTER =	APDU_LITERAL("00A4020C 02 0033");
+	const ApduLiteral KEYUSAGE =		APDU_LITERAL("00A4020C 02 0013");
+	const ApduLiteral PINRETRY =		APDU_LITERAL("00A4020C 02 0016");
+	const ApduLiteral READBINARY =	APDU_LITERAL("00B00000 00");
+	const ApduLiteral READRECORD =	APDU_LITERAL("00B20004 00");
+	const ApduLiteral SECENV1 =		APDU_LITERAL("0022F301");// 00"; // Compatibilty for some cards
+	const ApduLiteral SECENV3 =		APDU_LITERAL("0022F303 00");
+	const ApduLiteral CHANGE =		APDU_LITERAL("00240000 00");
+	const ApduLiteral REPLACE =		APDU_LITERAL("002C0000 00");
+	const ApduLiteral VERIFY =		APDU_LITERAL("00200000 00");
 };
 
 class QSmartCardDataPrivate: public QSharedData
 {
 public:
+	QSmartCardDataPrivate() = default;
+	QSmartCardDataPrivate(const QSmartCardDataPrivate &other);
+
+	static int dateIndex(QSmartCardData::PersonalDataType type);
+	static QString fromCP1252(const QByteArray &data);
+	void appendRecord(QSmartCardData::PersonalDataType type, const QByteArray &record);
+	void clearData(); // Forget everything read from card
+	void setData(QSmartCardData::PersonalDataType type, const QString &value);
+	void setData(QSmartCardData::PersonalDataType type, const QDateTime &value);
+	void setCertificates(const SslCertificate &auth, const SslCertificate &sign);
+	bool samePersonalData(const QSmartCardDataPrivate &other) const;
+	QVariant value(QSmartCardData::PersonalDataType type) const;
+
 	QString card, reader;
 	QStringList cards, readers;
-	QHash<QSmartCardData::PersonalDataType,QVariant> data;
+	// Raw personal data records stored back to back, decoded on first access
+	QByteArray records;
+	std::array<int,QSmartCardData::Email + 1> recordEnd{};
+	quint32 raw = 0; // Bit per PersonalDataType stored in records
+	quint32 present = 0; // Bit per PersonalDataType read from card
+	// Decoded personal data indexed by PersonalDataType, date fields are kept in dates
+	mutable QMutex decodeLock;
+	mutable std::array<QString,QSmartCardData::Email + 1> text;
+	mutable std::array<QDateTime,3> dates;
+	mutable quint32 decoded = 0;
 	SslCertificate authCert, signCert;
-	QHash<QSmartCardData::PinType,quint8> retry;
-	QHash<QSmartCardData::PinType,ulong> usage;
+	bool loaded = false; // Version, counters and personal data, first loading stage
+	bool certsLoaded = false; // Certificates, second stage or on demand
+	bool cached = false; // Restored from cache, counters are revalidated
+	std::array<quint8,QSmartCardData::PukType + 1> retry{}; // Indexed by PinType
+	std::array<ulong,QSmartCardData::PukType + 1> usage{};
 	QSmartCardData::CardVersion version = QSmartCardData::VER_INVALID;
 	bool pinpad = false;
 };
@@ -20,6 +20,9 @@
 #include "Updater.h"
 #include "ui_Updater.h"
 
+#include "Apdu.h"
+#include "Executor.h"
+
 #include "common/Common.h"
 #include "common/Configuration.h"
 #include "common/QPCSC.h"
@@ -27,6 +30,8 @@
 #include "common/Settings.h"
 #include "common/SslCertificate.h"
 
+#include <QtCore/QEventLoop>
+#include <QtCore/QFutureWatcher>
 #include <QtCore/QTimer>
 #include <QtCore/QJsonArray>
 #include <QtCore/QJsonDocument>
@@ -43,7 +48,6 @@
 #include <openssl/rsa.h>
 
 #include <memory>
-#include <thread>
 
 #define APDU(hex) QByteArray::fromHex(hex)
 
@@ -61,7 +65,9 @@ public:
 	QString session;
 	QNetworkRequest request;
 	QPCSCReader::Result verifyPIN(const QString &title, int p1) const;
+	void cancelTasks();
 	QtMessageHandler oldMsgHandler = nullptr;
+	QList<QFuture<void>> tasks; // Reader queue tasks using reader and dialog
 	QTimeLine *statusTimer = nullptr;
 
 	static int rsa_sign(int type, const unsigned char *m, unsigned int m_len,
@@ -78,8 +84,8 @@ public:
 		}
 
 		// Set card parameters
-		if(!d->reader->transfer(APDU("0022F301 00")).resultOk() || // SecENV 1
-			!d->reader->transfer(APDU("002241B8 02 8300")).resultOk()) //Key reference, 8303801100
+		if(!CardFile::transfer(d->reader, APDU_LITERAL("0022F301 00")).resultOk() || // SecENV 1
+			!CardFile::transfer(d->reader, APDU_LITERAL("002241B8 02 8300")).resultOk()) //Key reference, 8303801100
 		{
 			d->reader->endTransaction();
 			d->reader->disconnect();
@@ -87,10 +93,10 @@ public:
 		}
 
 		// calc signature
-		QByteArray cmd = APDU("00880000 00");
+		Apdu cmd(APDU_LITERAL("00880000 00"));
 		cmd[4] = m_len;
-		cmd += QByteArray::fromRawData((const char*)m, m_len);
-		QPCSCReader::Result result = d->reader->transfer(cmd);
+		cmd << QByteArray::fromRawData((const char*)m, m_len);
+		QPCSCReader::Result result = CardFile::transfer(d->reader, cmd);
 		d->reader->endTransaction();
 		d->reader->disconnect();
 		if(!result.resultOk())
@@ -102,6 +108,16 @@ public:
 	}
 };
 
+void UpdaterPrivate::cancelTasks()
+{
+	// Queued tasks are dropped, running one must finish before reader is deleted
+	for(QFuture<void> &task: tasks)
+		task.cancel();
+	for(QFuture<void> &task: tasks)
+		task.waitForFinished();
+	tasks.clear();
+}
+
 QPCSCReader::Result UpdaterPrivate::verifyPIN(const QString &title, int p1) const
 {
 	stackedWidget->setCurrentIndex(3);
@@ -155,18 +171,27 @@ QPCSCReader::Result UpdaterPrivate::verifyPIN(const QString &title, int p1) cons
 		pinLabel->setText(text + error + "<br />");
 		Common::setAccessibleName(pinLabel);
 
-		QByteArray verify = APDU("00200000 00");
+		Apdu verify(APDU_LITERAL("00200000 00"));
 		verify[3] = p1;
 		QPCSCReader::Result result;
 		if(reader->isPinPad())
 		{
 			pinProgress->setValue(pinProgress->maximum());
-			std::thread([&]{
-				result = reader->transferCTL(verify, true);
-				l.quit();
-			}).detach();
+			// Task may wait behind other reader tasks, it must not refer to this stack frame
+			QPCSCReader *pinpad = reader;
+			QByteArray apdu(verify.data().constData(), verify.size());
+			QFuture<QPCSCReader::Result> future = Executor::instance().run<QPCSCReader::Result>(reader->name(), [pinpad, apdu]{
+				return pinpad->transferCTL(apdu, true);
+			});
+			QFutureWatcher<QPCSCReader::Result> watcher;
+			QObject::connect(&watcher, &QFutureWatcherBase::finished, &l, &QEventLoop::quit);
+			watcher.setFuture(future);
 			statusTimer->start();
-			l.exec();
+			if(!future.isFinished())
+				l.exec();
+			future.waitForFinished();
+			if(future.isResultReadyAt(0))
+				result = future.result();
 		}
 		else
 		{
@@ -175,7 +200,7 @@ QPCSCReader::Result UpdaterPrivate::verifyPIN(const QString &title, int p1) cons
 			if(l.exec() == 1)
 			{
 				verify[4] = pinInput->text().size();
-				result = reader->transfer(verify + pinInput->text().toUtf8());
+				result = CardFile::transfer(reader, verify << pinInput->text().toUtf8());
 			}
 		}
 		switch( (quint8(result.SW[0]) << 8) + quint8(result.SW[1]) )
@@ -258,6 +283,7 @@ Updater::Updater(const QString &reader, QWidget *parent)
 
 Updater::~Updater()
 {
+	d->cancelTasks();
 	d->reader->endTransaction();
 	delete d->reader;
 	qInstallMessageHandler(d->oldMsgHandler);
@@ -293,7 +319,7 @@ void Updater::process(const QByteArray &data)
 			{"CONNECT", d->reader->isConnected() ? "OK" : "NOK"},
 			{"reader", d->reader->name()},
 			{"atr", d->reader->atr()},
-			{"protocol", d->reader->protocol() == 2 ? "T=1" : "T=0"},
+			{"protocol", d->reader->protocol() == QPCSCReader::T1 ? "T=1" : "T=0"},
 			{"pinpad", d->reader->isPinPad()}
 		};
 		if(err)
@@ -312,7 +338,11 @@ void Updater::process(const QByteArray &data)
 	}
 	else if(cmd == "APDU")
 	{
-		std::thread([=]{
+		// Reader queue keeps APDUs in order, tasks are dropped when dialog closes
+		for(int i = d->tasks.size() - 1; i >= 0; --i)
+			if(d->tasks[i].isFinished())
+				d->tasks.removeAt(i);
+		d->tasks << Executor::instance().submit(d->reader->name(), [=]{
 			QPCSCReader::Result result = d->reader->transfer(APDU(obj.value("bytes").toString().toLatin1()));
 			QVariantHash ret;
 			ret["APDU"] = result.err ? "NOK" : "OK";
@@ -320,7 +350,7 @@ void Updater::process(const QByteArray &data)
 			if(result.err)
 				ret["ERROR"] = QString::number(result.err, 16);
 			Q_EMIT send(ret);
-		}).detach();
+		});
 	}
 	else if(cmd == "MESSAGE")
 	{
@@ -418,29 +448,27 @@ int Updater::exec()
 	// Read certificate
 	d->reader->connect();
 	d->reader->beginTransaction();
-	if(!d->reader->transfer(APDU("00A40000 00")).resultOk())
+	const ApduLiteral masterFile = APDU_LITERAL("00A40000 00");
+	if(!CardFile::transfer(d->reader, masterFile).resultOk())
 	{
 		// Master file selection failed, test if it is updater applet
-		d->reader->transfer(APDU("00A40400 0A D2330000005550443101"));
-		d->reader->transfer(APDU("00A40000 00"));
+		CardFile::transfer(d->reader, APDU_LITERAL("00A40400 0A D2330000005550443101"));
+		CardFile::transfer(d->reader, masterFile);
 	}
-	d->reader->transfer(APDU("00A40000 00"));
-	d->reader->transfer(APDU("00A40100 02 EEEE"));
-	d->reader->transfer(APDU("00A40200 02 AACE"));
-	QByteArray certData;
-	while(certData.size() < 0x0600)
+	CardFile::transfer(d->reader, masterFile);
+	CardFile::transfer(d->reader, APDU_LITERAL("00A40100 02 EEEE"));
+	Apdu authCert(APDU_LITERAL("00A40200 02 AACE"));
+	if(d->reader->protocol() == QPCSCReader::T1)
+		authCert << char(0);
+	QPCSCReader::Result fci = CardFile::transfer(d->reader, authCert);
+	QHash<quint8,QByteArray> fciData = CardFile::parseFCI(fci.data);
+	int size = fciData.contains(0x85) ? quint8(fciData[0x85][0]) << 8 | quint8(fciData[0x85][1]) : 0x0600;
+	QByteArray certData = CardFile::readBinary(d->reader, size);
+	if(certData.isEmpty())
 	{
-		QByteArray apdu = APDU("00B00000 00");
-		apdu[2] = certData.size() >> 8;
-		apdu[3] = certData.size();
-		QPCSCReader::Result result = d->reader->transfer(apdu);
-		if(!result.resultOk())
-		{
-			d->reader->endTransaction();
-			d->label->setText(tr("Failed to read certificate"));
-			return QDialog::exec();
-		}
-		certData += result.data;
+		d->reader->endTransaction();
+		d->label->setText(tr("Failed to read certificate"));
+		return QDialog::exec();
 	}
 
 	d->reader->endTransaction();
@@ -589,7 +617,9 @@ int Updater::exec()
 	}, Qt::QueuedConnection);
 
 	Q_EMIT start();
-	return QDialog::exec();
+	int result = QDialog::exec();
+	d->cancelTasks();
+	return result;
 }
 
 void Updater::run()
@@ -19,11 +19,15 @@
  
 #include "sslConnect_p.h"
 
+#include "Executor.h"
+
 #include <common/Common.h>
 #include <common/Configuration.h>
 #include <common/Settings.h>
 #include <common/SOAPDocument.h>
 
+#include <QtCore/QEventLoop>
+#include <QtCore/QFutureWatcher>
 #include <QtCore/QJsonObject>
 #include <QtWidgets/QProgressBar>
 #include <QtWidgets/QProgressDialog>
@@ -57,7 +61,7 @@ void SSLConnectPrivate::setError( const QString &msg )
 }
 
 
-void SSLConnectPrivate::run()
+void SSLConnectPrivate::read()
 {
 	char data[4096];
 	int bytesRead = 0;
@@ -175,8 +179,9 @@ QByteArray SSLConnect::getUrl( RequestType type, const QString &value )
 	p.open();
 
 	QEventLoop e;
-	connect( d, SIGNAL(finished()), &e, SLOT(quit()) );
-	d->start();
+	QFutureWatcher<void> watcher;
+	connect( &watcher, SIGNAL(finished()), &e, SLOT(quit()) );
+	watcher.setFuture( Executor::instance().submit( QString(), [this]{ d->read(); } ) );
 	e.exec();
 
 	QMultiHash<QByteArray,QByteArray> headers;
@@ -21,7 +21,6 @@
 
 #include "sslConnect.h"
 
-#include <QtCore/QThread>
 #include <QtNetwork/QNetworkRequest>
 #include <QtNetwork/QSslCertificate>
 
@@ -42,13 +41,12 @@ private:
 	QByteArray m_data, m_method, m_ver;
 };
 
-class SSLConnectPrivate: public QThread
+class SSLConnectPrivate
 {
-	Q_OBJECT
 public:
-	SSLConnectPrivate(): QThread(), ctx(0), ssl(0) {}
+	SSLConnectPrivate(): ctx(0), ssl(0) {}
 
-	void run();
+	void read();
 	void setError( const QString &msg = QString() );
 
 	SSL_CTX *ctx;